@@ -0,0 +1,300 @@
+/*
+ * backlog.c
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * The python API opens the pipe in append mode, so when the daemon isn't
+ * running the messages pile up in a regular file at the pipe path. That
+ * file is moved aside before the pipe is created and read back by the
+ * ingest thread a few lines at a time, so even a large backlog doesn't
+ * hold up the startup. Repeated messages are only queued once and the
+ * control commands are skipped, they were meant for a daemon that isn't
+ * around anymore.
+ *
+ */
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "notifications.h"
+#include "ingest.h"
+#include "backlog.h"
+
+
+typedef struct {
+	kano_notifications_t *plugin_data;
+	int fd;
+	msgbuf_t buf;
+	gboolean eof;
+	gint64 written_at; /* real time in seconds, when it was last written */
+	GHashTable *seen; /* fingerprints of the lines queued so far */
+
+	guint recovered;
+	guint duplicates;
+
+	/* Held by each source scheduled to read the backlog. */
+	guint refs;
+} backlog_t;
+
+static void schedule_backlog(backlog_t *backlog, guint delay);
+
+/*
+ * Copy the new backlog to the end of the one that wasn't finished last
+ * time, on a line of its own.
+ *
+ * Returns TRUE if all of it was copied.
+ */
+static gboolean append_backlog(const gchar *pipe_filename,
+			       const gchar *backlog_filename)
+{
+	gchar buf[4096];
+	gchar last = '\n';
+	gssize count = 0;
+	int in, out;
+
+	in = open(pipe_filename, O_RDONLY | O_CLOEXEC);
+	if (in < 0) {
+		perror("open");
+		return FALSE;
+	}
+
+	out = open(backlog_filename, O_RDWR | O_APPEND | O_CLOEXEC);
+	if (out < 0) {
+		perror("open");
+		close(in);
+		return FALSE;
+	}
+
+	if (lseek(out, -1, SEEK_END) >= 0 && read(out, &last, 1) == 1 &&
+	    last != '\n' && write(out, "\n", 1) != 1)
+		count = -1;
+
+	while (count >= 0 && (count = read(in, buf, sizeof(buf))) > 0)
+		if (write(out, buf, count) != count)
+			count = -1;
+
+	if (count < 0)
+		perror("append");
+
+	close(in);
+	close(out);
+
+	return count == 0;
+}
+
+/*
+ * Move the regular file at the pipe path out of the way, if there is one.
+ *
+ * Returns TRUE if a backlog was found.
+ */
+gboolean stash_backlog(const gchar *pipe_filename)
+{
+	struct stat st;
+	gboolean stashed = FALSE;
+
+	if (lstat(pipe_filename, &st) < 0 || !S_ISREG(st.st_mode))
+		return FALSE;
+
+	gchar *backlog_filename = get_backlog_filename();
+	if (!backlog_filename)
+		return FALSE;
+
+	/* A backlog that wasn't finished last time is still there, the
+	   new one goes after it. Repeated lines are skipped when it's
+	   read back. */
+	if (access(backlog_filename, F_OK) == 0)
+		stashed = append_backlog(pipe_filename, backlog_filename);
+	else if (rename(pipe_filename, backlog_filename) == 0)
+		stashed = TRUE;
+	else
+		perror("rename");
+
+	g_free(backlog_filename);
+	return stashed;
+}
+
+static void unref_backlog(gpointer data)
+{
+	backlog_t *backlog = (backlog_t *)data;
+
+	if (--backlog->refs > 0)
+		return;
+
+	close(backlog->fd);
+	msgbuf_clear(&(backlog->buf));
+	g_hash_table_destroy(backlog->seen);
+	g_free(backlog);
+}
+
+/*
+ * The backlog has been read completely, it's not needed anymore.
+ */
+static void finish_backlog(backlog_t *backlog)
+{
+	g_debug("backlog: recovered %u notifications, %u duplicates",
+		backlog->recovered, backlog->duplicates);
+
+	gchar *backlog_filename = get_backlog_filename();
+	if (backlog_filename) {
+		unlink(backlog_filename);
+		g_free(backlog_filename);
+	}
+}
+
+/*
+ * The ttl of a message in the backlog counts from when it was written
+ * rather than from when it's read, however many times the daemon has
+ * started since. The time the file was last written is the closest
+ * there is to that. An explicit expires_at is left as it is, the ttl is
+ * only set when the expiry came from it, see get_json_notification().
+ */
+static void date_backlog_notification(backlog_t *backlog,
+				      notification_info_t *data)
+{
+	guint default_ttl = backlog->plugin_data->conf.default_ttl;
+
+	if (data->ttl > 0)
+		data->expires_at = backlog->written_at + data->ttl;
+	else if (data->expires_at == 0 && default_ttl > 0)
+		data->expires_at = backlog->written_at + default_ttl;
+}
+
+/*
+ * Runs on the ingest thread. Parse the next few lines of the backlog and
+ * hand them over to the GTK main loop.
+ */
+static gboolean backlog_cb(gpointer data)
+{
+	backlog_t *backlog = (backlog_t *)data;
+	kano_notifications_t *plugin_data = backlog->plugin_data;
+	notification_info_t *notification;
+	msgbuf_result_t framing;
+	gchar *msg;
+	guint64 fingerprint, *key;
+	guint lines = 0;
+	gboolean handed_off = FALSE;
+	gssize count;
+
+	/* The overflow policy is applied by the queue, so everything needs
+	   to get there rather than being turned down for a full ring. */
+	if (spsc_ring_count(&(plugin_data->handoff)) + BACKLOG_LINES_PER_RUN >
+	    plugin_data->handoff.mask + 1) {
+		schedule_backlog(backlog, BACKLOG_RETRY_DELAY);
+		return G_SOURCE_REMOVE;
+	}
+
+	while (lines < BACKLOG_LINES_PER_RUN) {
+		framing = msgbuf_next(&(backlog->buf), &msg, NULL);
+
+		if (framing == MSGBUF_NEED_MORE) {
+			if (backlog->eof)
+				break;
+
+			count = msgbuf_fill(&(backlog->buf), backlog->fd);
+			if (count <= 0)
+				backlog->eof = TRUE;
+			continue;
+		}
+
+		lines++;
+
+		if (framing != MSGBUF_MESSAGE || !plugin_data->conf.enabled)
+			continue;
+
+		fingerprint = fingerprint_message(msg);
+		if (g_hash_table_contains(backlog->seen, &fingerprint)) {
+			backlog->duplicates++;
+			continue;
+		}
+
+		notification = parse_notification(msg);
+		if (!notification)
+			continue;
+
+		date_backlog_notification(backlog, notification);
+
+		key = g_new(guint64, 1);
+		*key = fingerprint;
+		g_hash_table_add(backlog->seen, key);
+
+		if (hand_off_notification(plugin_data, notification) == INGEST_OK) {
+			backlog->recovered++;
+			handed_off = TRUE;
+		}
+	}
+
+	if (handed_off)
+		wake_up_ui(plugin_data);
+
+	if (lines < BACKLOG_LINES_PER_RUN) {
+		finish_backlog(backlog);
+		return G_SOURCE_REMOVE;
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Run backlog_cb on the ingest thread, either when it's idle or after a
+ * delay in milliseconds.
+ */
+static void schedule_backlog(backlog_t *backlog, guint delay)
+{
+	GSource *source;
+
+	if (delay > 0)
+		source = g_timeout_source_new(delay);
+	else
+		source = g_idle_source_new();
+
+	g_source_set_priority(source, G_PRIORITY_LOW);
+	backlog->refs++;
+	g_source_set_callback(source, backlog_cb, backlog, unref_backlog);
+	g_source_attach(source, backlog->plugin_data->ingest_context);
+	g_source_unref(source);
+}
+
+/*
+ * Start reading the backlog stashed by stash_backlog() on the ingest
+ * thread, if there is one.
+ */
+void recover_backlog(kano_notifications_t *plugin_data)
+{
+	backlog_t *backlog;
+	struct stat st;
+	int fd;
+
+	gchar *backlog_filename = get_backlog_filename();
+	if (!backlog_filename)
+		return;
+
+	fd = open(backlog_filename, O_RDONLY | O_CLOEXEC);
+	g_free(backlog_filename);
+
+	if (fd < 0) {
+		if (errno != ENOENT)
+			perror("open");
+		return;
+	}
+
+	backlog = g_new0(backlog_t, 1);
+	backlog->plugin_data = plugin_data;
+	backlog->fd = fd;
+	backlog->eof = FALSE;
+	backlog->written_at = fstat(fd, &st) == 0 ?
+			      st.st_mtime : g_get_real_time() / G_USEC_PER_SEC;
+	backlog->seen = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+					      g_free, NULL);
+	msgbuf_init(&(backlog->buf), plugin_data->conf.max_message_size);
+
+	schedule_backlog(backlog, 0);
+}
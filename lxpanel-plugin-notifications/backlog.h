@@ -0,0 +1,30 @@
+/*
+ * backlog.h
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * Recovery of the notifications that were written to a regular file at
+ * the pipe path while the daemon wasn't running.
+ *
+ */
+
+#include <glib.h>
+
+#include "notifications.h"
+
+#ifndef notif_backlog_h
+#define notif_backlog_h
+
+/* How many lines are parsed before giving the ingest loop a chance to
+   handle anything else. */
+#define BACKLOG_LINES_PER_RUN 64
+
+/* How long to wait for the GTK loop to catch up when the handoff ring
+   is getting full, in milliseconds. */
+#define BACKLOG_RETRY_DELAY 50
+
+gboolean stash_backlog(const gchar *pipe_filename);
+void recover_backlog(kano_notifications_t *plugin_data);
+
+#endif
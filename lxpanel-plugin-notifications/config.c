@@ -15,32 +15,54 @@
 #include <stdlib.h>
 
 /*
- * Resolve the path to the pipe file in the user's $HOME directory.
+ * Resolve the path to a file in the user's $HOME directory.
  *
  * WARNING: You're expected to g_free() the string returned.
  */
-gchar *get_fifo_filename(void)
+static gchar *get_home_filename(const gchar *filename)
 {
 	struct passwd *pw = getpwuid(getuid());
 	const char *homedir = pw->pw_dir;
 
 	/* You are responsible for freeing the returned char buffer */
 	int buff_len;
-	buff_len = strlen(homedir) + strlen(FIFO_FILENAME) + sizeof(char) * 2;
+	buff_len = strlen(homedir) + strlen(filename) + sizeof(char) * 2;
 
-	gchar *fifo_filename = g_new0(gchar, buff_len);
-	if (!fifo_filename) {
+	gchar *home_filename = g_new0(gchar, buff_len);
+	if (!home_filename) {
 		return NULL;
 	}
 	else {
-		g_strlcpy(fifo_filename, homedir, buff_len);
-		g_strlcat(fifo_filename, "/", buff_len);
-		g_strlcat(fifo_filename, FIFO_FILENAME, buff_len);
-		return (fifo_filename);
+		g_strlcpy(home_filename, homedir, buff_len);
+		g_strlcat(home_filename, "/", buff_len);
+		g_strlcat(home_filename, filename, buff_len);
+		return (home_filename);
 	}
 }
 
 
+/*
+ * Resolve the path to the pipe file in the user's $HOME directory.
+ *
+ * WARNING: You're expected to g_free() the string returned.
+ */
+gchar *get_fifo_filename(void)
+{
+	return get_home_filename(FIFO_FILENAME);
+}
+
+
+/*
+ * Resolve the path to the socket file in the user's $HOME directory.
+ *
+ * WARNING: You're expected to g_free() the string returned.
+ */
+gchar *get_socket_filename(void)
+{
+	return get_home_filename(SOCKET_FILENAME);
+}
+
+
 /*
  * Resolve the path to the config file in the user's $HOME directory.
  *
@@ -48,23 +70,74 @@ gchar *get_fifo_filename(void)
  */
 gchar *get_conf_filename(void)
 {
-	struct passwd *pw = getpwuid(getuid());
-	const char *homedir = pw->pw_dir;
+	return get_home_filename(CONF_FILENAME);
+}
 
-	/* You are responsible for freeing the returned char buffer */
-	int buff_len;
-	buff_len = strlen(homedir) + strlen(CONF_FILENAME) + sizeof(char) * 2;
 
-	gchar *conf_filename = g_new0(gchar, buff_len);
-	if (!conf_filename) {
+/*
+ * Resolve the path to the file which holds the notifications that didn't
+ * fit in the queue.
+ *
+ * WARNING: You're expected to g_free() the string returned.
+ */
+gchar *get_spill_filename(void)
+{
+	return get_home_filename(SPILL_FILENAME);
+}
+
+
+/*
+ * Resolve the path to the journal of queued notifications.
+ *
+ * WARNING: You're expected to g_free() the string returned.
+ */
+gchar *get_journal_filename(void)
+{
+	return get_home_filename(JOURNAL_FILENAME);
+}
+
+/*
+ * Resolve the path to where the backlog left at the pipe path is moved
+ * before it's read back.
+ *
+ * WARNING: You're expected to g_free() the string returned.
+ */
+gchar *get_backlog_filename(void)
+{
+	return get_home_filename(BACKLOG_FILENAME);
+}
+
+
+/*
+ * The names of the overflow policies as used in the configuration file.
+ */
+static const gchar *overflow_policy_names[] = {
+	[OVERFLOW_DROP_NEWEST] = "drop-newest",
+	[OVERFLOW_DROP_OLDEST] = "drop-oldest",
+	[OVERFLOW_COALESCE_BY_TYPE] = "coalesce-by-type",
+	[OVERFLOW_SPILL_TO_DISK] = "spill-to-disk",
+};
+
+const gchar *overflow_policy_to_string(overflow_policy_t policy)
+{
+	if (policy >= N_OVERFLOW_POLICIES)
 		return NULL;
-	}
-	else {
-		g_strlcpy(conf_filename, homedir, buff_len);
-		g_strlcat(conf_filename, "/", buff_len);
-		g_strlcat(conf_filename, CONF_FILENAME, buff_len);
-		return (conf_filename);
-	}
+
+	return overflow_policy_names[policy];
+}
+
+/*
+ * Returns the default policy if the name isn't recognised.
+ */
+overflow_policy_t overflow_policy_from_string(const gchar *name)
+{
+	overflow_policy_t policy;
+
+	for (policy = 0; policy < N_OVERFLOW_POLICIES; policy++)
+		if (g_strcmp0(name, overflow_policy_names[policy]) == 0)
+			return policy;
+
+	return DEFAULT_OVERFLOW_POLICY;
 }
 
 
@@ -133,6 +206,29 @@ int save_conf(struct notification_conf *conf)
 	json_object_set_boolean(root_object, "enabled", conf->enabled);
 	json_object_set_boolean(root_object, "allow_world_notifications",
 				conf->allow_world_notifications);
+	json_object_set_number(root_object, "max_queue_len",
+			       conf->max_queue_len);
+	json_object_set_string(root_object, "overflow_policy",
+			       overflow_policy_to_string(conf->overflow_policy));
+	json_object_set_number(root_object, "journal_sync_interval",
+			       conf->journal_sync_interval);
+	json_object_set_number(root_object, "max_message_size",
+			       conf->max_message_size);
+	json_object_set_number(root_object, "on_time", conf->on_time);
+	json_object_set_number(root_object, "min_on_time", conf->min_on_time);
+	json_object_set_number(root_object, "stack_size", conf->stack_size);
+	json_object_set_number(root_object, "default_ttl", conf->default_ttl);
+	json_object_set_number(root_object, "digest_threshold",
+			       conf->digest_threshold);
+
+	JSON_Value *categories = json_value_init_array();
+	gchar **category;
+
+	for (category = conf->coalesce_categories; category && *category;
+	     category++)
+		json_array_append_string(json_value_get_array(categories),
+					 *category);
+	json_object_set_value(root_object, "coalesce_categories", categories);
 
 	status = json_serialize_to_file(root_value, conf_file);
 
@@ -144,6 +240,29 @@ int save_conf(struct notification_conf *conf)
 }
 
 
+/*
+ * The list of coalescible categories, the default one if it's not set.
+ */
+static gchar **load_categories(JSON_Array *array)
+{
+	gchar **categories;
+	const gchar *category;
+	gsize i, n = 0;
+
+	if (!array)
+		return g_strsplit(DEFAULT_COALESCE_CATEGORIES, ",", -1);
+
+	categories = g_new0(gchar *, json_array_get_count(array) + 1);
+	for (i = 0; i < json_array_get_count(array); i++) {
+		category = json_array_get_string(array, i);
+		if (category)
+			categories[n++] = g_strdup(category);
+	}
+
+	return categories;
+}
+
+
 /*
  * Load the configuration from the current user's $HOME.
  */
@@ -168,6 +287,59 @@ void load_conf(struct notification_conf *conf)
 			conf->allow_world_notifications = json_object_get_boolean(root,
 							"allow_world_notifications");
 
+			/* Older configurations don't have these. */
+			conf->max_queue_len = json_object_get_number(root,
+							"max_queue_len");
+			if (conf->max_queue_len == 0)
+				conf->max_queue_len = DEFAULT_MAX_QUEUE_LEN;
+
+			conf->overflow_policy = overflow_policy_from_string(
+				json_object_get_string(root, "overflow_policy"));
+
+			/* Zero is valid here, so check it's actually set. */
+			if (json_object_get_value(root, "journal_sync_interval"))
+				conf->journal_sync_interval = json_object_get_number(root,
+							"journal_sync_interval");
+			else
+				conf->journal_sync_interval = DEFAULT_JOURNAL_SYNC_INTERVAL;
+
+			conf->max_message_size = json_object_get_number(root,
+							"max_message_size");
+			if (conf->max_message_size == 0)
+				conf->max_message_size = DEFAULT_MAX_MESSAGE_SIZE;
+
+			conf->on_time = json_object_get_number(root, "on_time");
+			if (conf->on_time == 0)
+				conf->on_time = DEFAULT_ON_TIME;
+
+			conf->min_on_time = json_object_get_number(root,
+							"min_on_time");
+			if (conf->min_on_time == 0)
+				conf->min_on_time = DEFAULT_MIN_ON_TIME;
+
+			conf->stack_size = json_object_get_number(root,
+							"stack_size");
+			if (conf->stack_size == 0)
+				conf->stack_size = DEFAULT_STACK_SIZE;
+			conf->stack_size = MIN(conf->stack_size, MAX_STACK_SIZE);
+
+			/* Zero is valid here too. */
+			if (json_object_get_value(root, "default_ttl"))
+				conf->default_ttl = json_object_get_number(root,
+							"default_ttl");
+			else
+				conf->default_ttl = DEFAULT_TTL;
+
+			/* And here. */
+			if (json_object_get_value(root, "digest_threshold"))
+				conf->digest_threshold = json_object_get_number(root,
+							"digest_threshold");
+			else
+				conf->digest_threshold = DEFAULT_DIGEST_THRESHOLD;
+
+			conf->coalesce_categories = load_categories(
+				json_object_get_array(root, "coalesce_categories"));
+
 			json_value_free(root_value);
 			return;
 		}
@@ -178,6 +350,16 @@ void load_conf(struct notification_conf *conf)
 	/* There's no or broken configuration, so create a default one. */
 	conf->enabled = TRUE;
 	conf->allow_world_notifications = TRUE;
+	conf->max_queue_len = DEFAULT_MAX_QUEUE_LEN;
+	conf->overflow_policy = DEFAULT_OVERFLOW_POLICY;
+	conf->journal_sync_interval = DEFAULT_JOURNAL_SYNC_INTERVAL;
+	conf->max_message_size = DEFAULT_MAX_MESSAGE_SIZE;
+	conf->on_time = DEFAULT_ON_TIME;
+	conf->min_on_time = DEFAULT_MIN_ON_TIME;
+	conf->stack_size = DEFAULT_STACK_SIZE;
+	conf->default_ttl = DEFAULT_TTL;
+	conf->digest_threshold = DEFAULT_DIGEST_THRESHOLD;
+	conf->coalesce_categories = load_categories(NULL);
 	save_conf(conf);
 
 	return;
@@ -25,11 +25,22 @@
 #define notif_config_h
 
 #define FIFO_FILENAME ".kano-notifications-desktop.fifo"
+#define SOCKET_FILENAME ".kano-notifications-desktop.sock"
 #define CONF_FILENAME ".kano-notifications.conf"
+#define SPILL_FILENAME ".kano-notifications-spill"
+#define JOURNAL_FILENAME ".kano-notifications-journal"
+#define BACKLOG_FILENAME ".kano-notifications-desktop.backlog"
 
 
 gchar *get_fifo_filename(void);
+gchar *get_socket_filename(void);
 gchar *get_conf_filename(void);
+gchar *get_spill_filename(void);
+gchar *get_journal_filename(void);
+gchar *get_backlog_filename(void);
+
+const gchar *overflow_policy_to_string(overflow_policy_t policy);
+overflow_policy_t overflow_policy_from_string(const gchar *name);
 
 int save_conf(struct notification_conf *conf);
 void load_conf(struct notification_conf *conf);
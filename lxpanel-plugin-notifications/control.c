@@ -0,0 +1,524 @@
+/*
+ * control.c
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * A control command is a line starting with CONTROL_PREFIX, followed by
+ * the name of the command and its arguments separated by whitespace:
+ *
+ *   !pause
+ *   !set on_time 10
+ *   !get max_queue_len
+ *
+ * Each of them gets a single line in reply when sent over the socket,
+ * either "ok", "ok <value>", "ignored" or "error <reason>".
+ *
+ * The commands that existed before can still be sent as bare words
+ * without arguments, e.g. "pause". Those only get a reply in ack mode,
+ * like the notifications.
+ *
+ * All of this runs on the ingest thread.
+ *
+ */
+
+#include <glib.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "notifications.h"
+#include "control.h"
+#include "server.h"
+#include "ui.h"
+
+
+typedef gboolean (*control_func_t)(kano_notifications_t *plugin_data,
+				   ingest_source_t *src, gchar **args,
+				   GString *reply);
+
+struct control_command {
+	const gchar *name;
+	control_func_t func;
+	guint n_args;
+	gboolean legacy;	/* can be sent as a bare word */
+	gboolean always;	/* works while the notifications are disabled */
+};
+
+
+/*
+ * Change one of the flags in the configuration and save it.
+ */
+static void set_conf_flag(kano_notifications_t *plugin_data, gboolean *flag,
+			  gboolean value)
+{
+	g_mutex_lock(&(plugin_data->lock));
+	*flag = value;
+	g_mutex_unlock(&(plugin_data->lock));
+	save_conf(&(plugin_data->conf));
+}
+
+/*
+ * Socket producers can ask to get a reply to every message.
+ */
+static gboolean control_ack(kano_notifications_t *plugin_data,
+			    ingest_source_t *src, gchar **args, GString *reply)
+{
+	if (src->reply_fd < 0) {
+		g_string_append(reply, "nobody to reply to");
+		return FALSE;
+	}
+
+	src->ack = TRUE;
+	return TRUE;
+}
+
+static gboolean control_enable(kano_notifications_t *plugin_data,
+			       ingest_source_t *src, gchar **args,
+			       GString *reply)
+{
+	set_conf_flag(plugin_data, &(plugin_data->conf.enabled), TRUE);
+	return TRUE;
+}
+
+static gboolean control_disable(kano_notifications_t *plugin_data,
+				ingest_source_t *src, gchar **args,
+				GString *reply)
+{
+	set_conf_flag(plugin_data, &(plugin_data->conf.enabled), FALSE);
+	return TRUE;
+}
+
+static gboolean control_allow_world(kano_notifications_t *plugin_data,
+				    ingest_source_t *src, gchar **args,
+				    GString *reply)
+{
+	set_conf_flag(plugin_data,
+		      &(plugin_data->conf.allow_world_notifications), TRUE);
+	return TRUE;
+}
+
+static gboolean control_disallow_world(kano_notifications_t *plugin_data,
+				       ingest_source_t *src, gchar **args,
+				       GString *reply)
+{
+	set_conf_flag(plugin_data,
+		      &(plugin_data->conf.allow_world_notifications), FALSE);
+	return TRUE;
+}
+
+static gboolean control_pause(kano_notifications_t *plugin_data,
+			      ingest_source_t *src, gchar **args,
+			      GString *reply)
+{
+	g_mutex_lock(&(plugin_data->lock));
+	plugin_data->paused = TRUE;
+	g_mutex_unlock(&(plugin_data->lock));
+	return TRUE;
+}
+
+static gboolean control_resume(kano_notifications_t *plugin_data,
+			       ingest_source_t *src, gchar **args,
+			       GString *reply)
+{
+	g_mutex_lock(&(plugin_data->lock));
+	plugin_data->paused = FALSE;
+
+	g_idle_add((GSourceFunc) show_notification_window_from_q, plugin_data);
+
+	g_mutex_unlock(&(plugin_data->lock));
+	return TRUE;
+}
+
+
+/*
+ * The settings that can be read and changed at runtime.
+ */
+typedef enum {
+	SETTING_UINT,
+	SETTING_BOOL,
+	SETTING_OVERFLOW_POLICY,
+} setting_type_t;
+
+static const struct setting {
+	const gchar *name;
+	setting_type_t type;
+	glong offset;	/* in struct notification_conf */
+	guint min;
+	guint max;
+} settings[] = {
+	{ "on_time", SETTING_UINT,
+	  G_STRUCT_OFFSET(struct notification_conf, on_time), 1, 3600 },
+	{ "min_on_time", SETTING_UINT,
+	  G_STRUCT_OFFSET(struct notification_conf, min_on_time), 1, 3600 },
+	{ "stack_size", SETTING_UINT,
+	  G_STRUCT_OFFSET(struct notification_conf, stack_size),
+	  1, MAX_STACK_SIZE },
+	{ "default_ttl", SETTING_UINT,
+	  G_STRUCT_OFFSET(struct notification_conf, default_ttl),
+	  0, 7 * 24 * 60 * 60 },
+	{ "digest_threshold", SETTING_UINT,
+	  G_STRUCT_OFFSET(struct notification_conf, digest_threshold),
+	  0, 1000 },
+	{ "max_queue_len", SETTING_UINT,
+	  G_STRUCT_OFFSET(struct notification_conf, max_queue_len), 1, 10000 },
+	{ "max_message_size", SETTING_UINT,
+	  G_STRUCT_OFFSET(struct notification_conf, max_message_size),
+	  256, 16 * 1024 * 1024 },
+	{ "enabled", SETTING_BOOL,
+	  G_STRUCT_OFFSET(struct notification_conf, enabled), 0, 1 },
+	{ "allow_world_notifications", SETTING_BOOL,
+	  G_STRUCT_OFFSET(struct notification_conf, allow_world_notifications),
+	  0, 1 },
+	{ "overflow_policy", SETTING_OVERFLOW_POLICY,
+	  G_STRUCT_OFFSET(struct notification_conf, overflow_policy), 0, 0 },
+};
+
+static const struct setting *lookup_setting(const gchar *name)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(settings); i++)
+		if (strcmp(settings[i].name, name) == 0)
+			return &(settings[i]);
+
+	return NULL;
+}
+
+static void format_setting(kano_notifications_t *plugin_data,
+			   const struct setting *setting, GString *out)
+{
+	gpointer field = G_STRUCT_MEMBER_P(&(plugin_data->conf),
+					   setting->offset);
+
+	switch (setting->type) {
+	case SETTING_UINT:
+		g_string_append_printf(out, "%u", *(guint *)field);
+		break;
+	case SETTING_BOOL:
+		g_string_append(out, *(gboolean *)field ? "true" : "false");
+		break;
+	case SETTING_OVERFLOW_POLICY:
+		g_string_append(out, overflow_policy_to_string(
+			*(overflow_policy_t *)field));
+		break;
+	}
+}
+
+/*
+ * The message buffers of all the sources live on this thread, so a new
+ * limit can be applied to them straight away.
+ */
+static void apply_max_message_size(kano_notifications_t *plugin_data)
+{
+	gsize max = plugin_data->conf.max_message_size;
+	GList *iter;
+
+	plugin_data->fifo.buf.max_message = max;
+
+	for (iter = plugin_data->clients; iter; iter = iter->next)
+		((server_client_t *)iter->data)->src.buf.max_message = max;
+}
+
+/*
+ * There might be room for more notifications on the screen now.
+ */
+static void apply_stack_size(kano_notifications_t *plugin_data)
+{
+	if (!plugin_data->paused)
+		g_idle_add((GSourceFunc) show_notification_window_from_q,
+			   plugin_data);
+}
+
+static gboolean control_get(kano_notifications_t *plugin_data,
+			    ingest_source_t *src, gchar **args, GString *reply)
+{
+	const struct setting *setting = lookup_setting(args[0]);
+
+	if (!setting) {
+		g_string_append_printf(reply, "no setting called %s", args[0]);
+		return FALSE;
+	}
+
+	g_mutex_lock(&(plugin_data->lock));
+	format_setting(plugin_data, setting, reply);
+	g_mutex_unlock(&(plugin_data->lock));
+
+	return TRUE;
+}
+
+static gboolean control_set(kano_notifications_t *plugin_data,
+			    ingest_source_t *src, gchar **args, GString *reply)
+{
+	const struct setting *setting = lookup_setting(args[0]);
+	const gchar *value = args[1];
+	overflow_policy_t policy;
+	gchar *end;
+	gulong number;
+
+	if (!setting) {
+		g_string_append_printf(reply, "no setting called %s", args[0]);
+		return FALSE;
+	}
+
+	g_mutex_lock(&(plugin_data->lock));
+
+	gpointer field = G_STRUCT_MEMBER_P(&(plugin_data->conf),
+					   setting->offset);
+
+	switch (setting->type) {
+	case SETTING_UINT:
+		number = strtoul(value, &end, 10);
+		if (*value == '\0' || *end != '\0' ||
+		    number < setting->min || number > setting->max) {
+			g_string_append_printf(reply, "%s needs to be %u to %u",
+					       setting->name, setting->min,
+					       setting->max);
+			g_mutex_unlock(&(plugin_data->lock));
+			return FALSE;
+		}
+		*(guint *)field = number;
+		break;
+
+	case SETTING_BOOL:
+		if (g_strcmp0(value, "true") != 0 &&
+		    g_strcmp0(value, "false") != 0) {
+			g_string_append_printf(reply, "%s needs to be true or false",
+					       setting->name);
+			g_mutex_unlock(&(plugin_data->lock));
+			return FALSE;
+		}
+		*(gboolean *)field = g_strcmp0(value, "true") == 0;
+		break;
+
+	case SETTING_OVERFLOW_POLICY:
+		policy = overflow_policy_from_string(value);
+		if (g_strcmp0(overflow_policy_to_string(policy), value) != 0) {
+			g_string_append_printf(reply, "unknown overflow policy %s",
+					       value);
+			g_mutex_unlock(&(plugin_data->lock));
+			return FALSE;
+		}
+		*(overflow_policy_t *)field = policy;
+		break;
+	}
+
+	format_setting(plugin_data, setting, reply);
+	g_mutex_unlock(&(plugin_data->lock));
+
+	apply_max_message_size(plugin_data);
+	apply_stack_size(plugin_data);
+	save_conf(&(plugin_data->conf));
+
+	return TRUE;
+}
+
+static gboolean control_stats(kano_notifications_t *plugin_data,
+			      ingest_source_t *src, gchar **args,
+			      GString *reply)
+{
+	struct ingest_stats *stats = &(plugin_data->stats);
+	struct spill *spill = &(plugin_data->spill);
+	guint i, shown;
+
+	g_string_append_printf(reply,
+		"wakeups=%" G_GUINT64_FORMAT " lines=%" G_GUINT64_FORMAT
+		" max_batch=%u ingest_us=%" G_GINT64_FORMAT
+		" oversize=%" G_GUINT64_FORMAT
+		" queue_full=%" G_GUINT64_FORMAT " queued=%d",
+		stats->wakeups, stats->lines, stats->max_batch,
+		stats->total_ingest_us, stats->oversize, stats->queue_full,
+		g_atomic_int_get(&(plugin_data->queue_length)));
+
+	g_mutex_lock(&(spill->lock));
+	g_string_append_printf(reply,
+		" spilled=%" G_GUINT64_FORMAT " unspilled=%" G_GUINT64_FORMAT
+		" spill_lost=%" G_GUINT64_FORMAT,
+		spill->spilled, spill->unspilled, spill->lost);
+	g_mutex_unlock(&(spill->lock));
+
+	g_mutex_lock(&(plugin_data->lock));
+	g_string_append_printf(reply,
+		" queued_bytes=%" G_GSIZE_FORMAT
+		" dropped_newest=%" G_GUINT64_FORMAT
+		" dropped_oldest=%" G_GUINT64_FORMAT
+		" coalesced=%" G_GUINT64_FORMAT
+		" duplicates=%" G_GUINT64_FORMAT
+		" preempted=%" G_GUINT64_FORMAT
+		" superseded=%" G_GUINT64_FORMAT
+		" expired=%" G_GUINT64_FORMAT
+		" digested=%" G_GUINT64_FORMAT
+		" display_time=",
+		plugin_data->queue_bytes,
+		plugin_data->overflow.dropped_newest,
+		plugin_data->overflow.dropped_oldest,
+		plugin_data->overflow.coalesced,
+		plugin_data->duplicates,
+		plugin_data->preempted,
+		plugin_data->superseded,
+		plugin_data->expired,
+		plugin_data->digested);
+
+	/* One for each window on the screen. */
+	for (i = 0, shown = 0; i < MAX_STACK_SIZE; i++) {
+		if (!plugin_data->slots[i].window)
+			continue;
+
+		g_string_append_printf(reply, "%s%u", shown++ ? "," : "",
+				       plugin_data->slots[i].display_time);
+	}
+	if (shown == 0)
+		g_string_append(reply, "0");
+
+	g_mutex_unlock(&(plugin_data->lock));
+
+	return TRUE;
+}
+
+
+/*
+ * Every command lands in its own slot of control_slots, see
+ * hash_command(). Any change to the names needs a new hash.
+ */
+#define CONTROL_HASH_SIZE 16
+
+static const struct control_command control_commands[] = {
+	{ "ack", control_ack, 0, TRUE, TRUE },
+	{ "enable", control_enable, 0, TRUE, TRUE },
+	{ "disable", control_disable, 0, TRUE, FALSE },
+	{ "allow_world_notifications", control_allow_world, 0, TRUE, FALSE },
+	{ "disallow_world_notifications", control_disallow_world, 0, TRUE, FALSE },
+	{ "pause", control_pause, 0, TRUE, FALSE },
+	{ "resume", control_resume, 0, TRUE, FALSE },
+	{ "set", control_set, 2, FALSE, TRUE },
+	{ "get", control_get, 1, FALSE, TRUE },
+	{ "stats", control_stats, 0, FALSE, TRUE },
+};
+
+/* The index of each command in control_commands plus one, 0 is empty. */
+static const guint8 control_slots[CONTROL_HASH_SIZE] = {
+	[1] = 3,	/* disable */
+	[4] = 2,	/* enable */
+	[5] = 6,	/* pause */
+	[6] = 4,	/* allow_world_notifications */
+	[9] = 9,	/* get */
+	[11] = 7,	/* resume */
+	[12] = 10,	/* stats */
+	[13] = 8,	/* set */
+	[14] = 1,	/* ack */
+	[15] = 5,	/* disallow_world_notifications */
+};
+
+static guint hash_command(const gchar *name, gsize len)
+{
+	return ((guchar)name[0] * 3 + (guchar)name[len - 1]) % CONTROL_HASH_SIZE;
+}
+
+/*
+ * Find a command by the first len characters of name.
+ */
+static const struct control_command *lookup_control_command(const gchar *name,
+							    gsize len)
+{
+	const struct control_command *command;
+	guint slot;
+
+	if (len == 0)
+		return NULL;
+
+	slot = control_slots[hash_command(name, len)];
+	if (slot == 0)
+		return NULL;
+
+	command = &(control_commands[slot - 1]);
+	if (strncmp(command->name, name, len) != 0 || command->name[len] != '\0')
+		return NULL;
+
+	return command;
+}
+
+/*
+ * Whether the word is one of the commands that can be sent without
+ * CONTROL_PREFIX.
+ */
+gboolean is_legacy_command(const gchar *word, gsize len)
+{
+	const struct control_command *command = lookup_control_command(word, len);
+
+	return command && command->legacy;
+}
+
+/*
+ * Run a control command. The line is split into the name and arguments
+ * in place.
+ *
+ * The reply for commands sent with CONTROL_PREFIX is returned in reply,
+ * it's NULL for the bare ones.
+ */
+ingest_status_t handle_control(kano_notifications_t *plugin_data,
+			       ingest_source_t *src, gchar *line,
+			       gchar **reply)
+{
+	const struct control_command *command;
+	gboolean prefixed = line[0] == CONTROL_PREFIX;
+	gchar *name = prefixed ? line + 1 : line;
+	gchar *args[CONTROL_MAX_ARGS];
+	guint n_args = 0;
+	ingest_status_t status;
+	GString *text = g_string_new(NULL);
+	gsize len;
+	gchar *p;
+
+	for (p = name; *p && !g_ascii_isspace(*p); p++)
+		;
+	len = p - name;
+
+	while (*p && n_args <= CONTROL_MAX_ARGS) {
+		if (g_ascii_isspace(*p)) {
+			*p++ = '\0';
+			continue;
+		}
+
+		if (n_args < CONTROL_MAX_ARGS)
+			args[n_args] = p;
+		n_args++;
+
+		while (*p && !g_ascii_isspace(*p))
+			p++;
+	}
+
+	command = lookup_control_command(name, len);
+
+	if (!command || (!prefixed && !command->legacy)) {
+		status = INGEST_INVALID;
+		g_string_append(text, "unknown command");
+	} else if (n_args != command->n_args) {
+		status = INGEST_INVALID;
+		g_string_append_printf(text, "wrong number of arguments for %s",
+				       command->name);
+	} else if (!plugin_data->conf.enabled && !command->always) {
+		/* Everything is swallowed while the notifications are
+		   disabled. */
+		status = INGEST_IGNORED;
+	} else if (command->func(plugin_data, src, args, text)) {
+		status = INGEST_OK;
+	} else {
+		status = INGEST_INVALID;
+	}
+
+	if (prefixed) {
+		if (status == INGEST_OK)
+			*reply = g_strdup_printf(text->len ? "ok %s" : "ok",
+						 text->str);
+		else if (status == INGEST_IGNORED)
+			*reply = g_strdup("ignored");
+		else
+			*reply = g_strdup_printf("error %s", text->str);
+	} else {
+		*reply = NULL;
+	}
+
+	g_string_free(text, TRUE);
+	return status;
+}
@@ -0,0 +1,28 @@
+/*
+ * control.h
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * The control commands which change the state of the daemon at runtime.
+ *
+ */
+
+#include <glib.h>
+
+#include "notifications.h"
+
+#ifndef notif_control_h
+#define notif_control_h
+
+/* Starts a command that takes arguments and always gets a reply. */
+#define CONTROL_PREFIX '!'
+
+#define CONTROL_MAX_ARGS 4
+
+gboolean is_legacy_command(const gchar *word, gsize len);
+ingest_status_t handle_control(kano_notifications_t *plugin_data,
+			       ingest_source_t *src, gchar *line,
+			       gchar **reply);
+
+#endif
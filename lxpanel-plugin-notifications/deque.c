@@ -0,0 +1,146 @@
+/*
+ * deque.c
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * The ring is sized up front and only grows, by doubling, if more items
+ * than that have to be kept. Items are moved within the ring when one
+ * is inserted or removed in the middle, always on the shorter side, so
+ * doing that right next to either end is as cheap as pushing or popping.
+ *
+ */
+
+#include <glib.h>
+
+#include <string.h>
+
+#include "deque.h"
+
+
+void deque_init(deque_t *deque, guint capacity)
+{
+	guint size = 1;
+
+	while (size < capacity)
+		size <<= 1;
+
+	deque->slots = g_new0(gpointer, size);
+	deque->mask = size - 1;
+	deque->head = 0;
+	deque->length = 0;
+}
+
+void deque_clear(deque_t *deque)
+{
+	g_free(deque->slots);
+	deque->slots = NULL;
+	deque->mask = 0;
+	deque->head = 0;
+	deque->length = 0;
+}
+
+/*
+ * Double the capacity when the ring is full. The items are copied over
+ * in order, starting at the first slot of the new ring.
+ */
+static void deque_reserve(deque_t *deque)
+{
+	guint size = deque->mask + 1;
+	guint first = size - deque->head;
+	gpointer *slots;
+
+	if (deque->length < size)
+		return;
+
+	slots = g_new0(gpointer, size * 2);
+
+	memcpy(slots, deque->slots + deque->head, first * sizeof(gpointer));
+	memcpy(slots + first, deque->slots, deque->head * sizeof(gpointer));
+
+	g_free(deque->slots);
+	deque->slots = slots;
+	deque->mask = size * 2 - 1;
+	deque->head = 0;
+}
+
+void deque_push_tail(deque_t *deque, gpointer item)
+{
+	deque_reserve(deque);
+
+	deque->length++;
+	deque_set_nth(deque, deque->length - 1, item);
+}
+
+/*
+ * Returns NULL if the deque is empty.
+ */
+gpointer deque_pop_head(deque_t *deque)
+{
+	gpointer item;
+
+	if (deque->length == 0)
+		return NULL;
+
+	item = deque_nth(deque, 0);
+	deque->head = (deque->head + 1) & deque->mask;
+	deque->length--;
+
+	return item;
+}
+
+/*
+ * Put an item at the given position, the ones from there on move one
+ * position back. An index equal to the length appends it.
+ */
+void deque_insert(deque_t *deque, guint index, gpointer item)
+{
+	guint i;
+
+	if (index > deque->length)
+		index = deque->length;
+
+	deque_reserve(deque);
+
+	if (index < deque->length / 2) {
+		/* Move the ones before it one slot towards the front. */
+		deque->head = (deque->head - 1) & deque->mask;
+		for (i = 0; i < index; i++)
+			deque_set_nth(deque, i, deque_nth(deque, i + 1));
+	} else {
+		for (i = deque->length; i > index; i--)
+			deque_set_nth(deque, i, deque_nth(deque, i - 1));
+	}
+
+	deque->length++;
+	deque_set_nth(deque, index, item);
+}
+
+/*
+ * Take the item at the given position out, closing the gap it leaves.
+ *
+ * Returns NULL if there's no such position.
+ */
+gpointer deque_remove(deque_t *deque, guint index)
+{
+	gpointer item;
+	guint i;
+
+	if (index >= deque->length)
+		return NULL;
+
+	item = deque_nth(deque, index);
+
+	if (index < deque->length / 2) {
+		for (i = index; i > 0; i--)
+			deque_set_nth(deque, i, deque_nth(deque, i - 1));
+		deque->head = (deque->head + 1) & deque->mask;
+	} else {
+		for (i = index; i + 1 < deque->length; i++)
+			deque_set_nth(deque, i, deque_nth(deque, i + 1));
+	}
+
+	deque->length--;
+
+	return item;
+}
@@ -0,0 +1,70 @@
+/*
+ * deque.h
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * A double ended queue of pointers kept in a single ring of slots.
+ * It isn't thread safe, the callers take care of the locking.
+ *
+ */
+
+#include <glib.h>
+
+#ifndef notif_deque_h
+#define notif_deque_h
+
+typedef struct {
+	gpointer *slots;
+	guint mask;		/* capacity - 1, the capacity is a power of 2 */
+	guint head;		/* slot of the first item */
+	guint length;
+} deque_t;
+
+void deque_init(deque_t *deque, guint capacity);
+void deque_clear(deque_t *deque);
+
+void deque_push_tail(deque_t *deque, gpointer item);
+gpointer deque_pop_head(deque_t *deque);
+void deque_insert(deque_t *deque, guint index, gpointer item);
+gpointer deque_remove(deque_t *deque, guint index);
+
+static inline guint deque_length(const deque_t *deque)
+{
+	return deque->length;
+}
+
+/*
+ * The item at the given position counting from the head. The index must
+ * be within the deque.
+ */
+static inline gpointer deque_nth(const deque_t *deque, guint index)
+{
+	return deque->slots[(deque->head + index) & deque->mask];
+}
+
+static inline void deque_set_nth(deque_t *deque, guint index, gpointer item)
+{
+	deque->slots[(deque->head + index) & deque->mask] = item;
+}
+
+/*
+ * Forget the items past the given length.
+ */
+static inline void deque_truncate(deque_t *deque, guint length)
+{
+	if (length < deque->length)
+		deque->length = length;
+}
+
+static inline gpointer deque_peek_head(const deque_t *deque)
+{
+	return deque->length ? deque_nth(deque, 0) : NULL;
+}
+
+static inline gpointer deque_peek_tail(const deque_t *deque)
+{
+	return deque->length ? deque_nth(deque, deque->length - 1) : NULL;
+}
+
+#endif
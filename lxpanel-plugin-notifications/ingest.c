@@ -0,0 +1,261 @@
+/*
+ * ingest.c
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * All the reading and parsing of messages runs in a separate thread with
+ * its own main context, so slow parsing never holds up the UI. Finished
+ * notifications are passed to the GTK main loop through a lock-free ring
+ * and an eventfd wakes it up to queue them.
+ *
+ */
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/eventfd.h>
+
+#include "config.h"
+#include "notifications.h"
+#include "ingest.h"
+#include "ui.h"
+#include "queue.h"
+
+
+/*
+ * Runs on the GTK main loop. Move everything that's been handed over
+ * into the queue under a single acquisition of the lock.
+ */
+static gboolean handoff_watch_cb(GIOChannel *source, GIOCondition cond,
+				 gpointer data)
+{
+	kano_notifications_t *plugin_data = (kano_notifications_t *)data;
+	notification_info_t *notification;
+	uint64_t count;
+	gboolean queued = FALSE;
+
+	/* Only resets the counter, the ring says how much there is. */
+	if (read(plugin_data->handoff_fd, &count, sizeof(count)) < 0 &&
+	    errno != EAGAIN)
+		perror("read");
+
+	g_mutex_lock(&(plugin_data->lock));
+
+	while ((notification = spsc_ring_pop(&(plugin_data->handoff))) != NULL)
+		if (enqueue_notification_unsafe(plugin_data, notification) ==
+		    INGEST_OK)
+			queued = TRUE;
+
+	if (queued && !plugin_data->paused)
+		g_idle_add((GSourceFunc) show_notification_window_from_q,
+			   plugin_data);
+
+	g_mutex_unlock(&(plugin_data->lock));
+
+	return TRUE;
+}
+
+/*
+ * Set up the context for the ingest thread and the way back to the GTK
+ * main loop. This needs to be called before any watches are added with
+ * ingest_add_watch().
+ */
+void init_ingest(kano_notifications_t *plugin_data)
+{
+	plugin_data->ingest_context = g_main_context_new();
+	plugin_data->ingest_loop = g_main_loop_new(plugin_data->ingest_context,
+						   FALSE);
+	plugin_data->ingest_thread = NULL;
+
+	spsc_ring_init(&(plugin_data->handoff), HANDOFF_RING_SIZE);
+
+	plugin_data->handoff_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (plugin_data->handoff_fd < 0) {
+		perror("eventfd");
+		return;
+	}
+
+	plugin_data->handoff_channel = g_io_channel_unix_new(plugin_data->handoff_fd);
+	plugin_data->handoff_watch_id = g_io_add_watch(plugin_data->handoff_channel,
+						       G_IO_IN,
+						       (GIOFunc)handoff_watch_cb,
+						       (gpointer)plugin_data);
+}
+
+/*
+ * Free up everything init_ingest() created, including notifications that
+ * were handed over but never queued. The thread must be stopped and all
+ * the watches removed by now.
+ */
+void clear_ingest(kano_notifications_t *plugin_data)
+{
+	notification_info_t *notification;
+
+	if (plugin_data->handoff_fd >= 0) {
+		g_source_remove(plugin_data->handoff_watch_id);
+		g_io_channel_unref(plugin_data->handoff_channel);
+		close(plugin_data->handoff_fd);
+	}
+
+	while ((notification = spsc_ring_pop(&(plugin_data->handoff))) != NULL)
+		free_notification(notification);
+	spsc_ring_clear(&(plugin_data->handoff));
+
+	g_main_loop_unref(plugin_data->ingest_loop);
+	g_main_context_unref(plugin_data->ingest_context);
+}
+
+static gpointer ingest_thread(gpointer data)
+{
+	kano_notifications_t *plugin_data = (kano_notifications_t *)data;
+
+	g_main_context_push_thread_default(plugin_data->ingest_context);
+	g_main_loop_run(plugin_data->ingest_loop);
+	g_main_context_pop_thread_default(plugin_data->ingest_context);
+
+	return NULL;
+}
+
+void start_ingest_thread(kano_notifications_t *plugin_data)
+{
+	plugin_data->ingest_thread = g_thread_new("ingest", ingest_thread,
+						  plugin_data);
+}
+
+void stop_ingest_thread(kano_notifications_t *plugin_data)
+{
+	if (!plugin_data->ingest_thread)
+		return;
+
+	g_main_loop_quit(plugin_data->ingest_loop);
+	g_thread_join(plugin_data->ingest_thread);
+	plugin_data->ingest_thread = NULL;
+}
+
+/*
+ * Same as g_io_add_watch(), but the callback runs in the ingest thread.
+ *
+ * Returns the source, which needs to be removed with ingest_remove_watch().
+ */
+GSource *ingest_add_watch(kano_notifications_t *plugin_data,
+			  GIOChannel *channel, GIOCondition cond,
+			  GIOFunc func, gpointer data)
+{
+	GSource *watch = g_io_create_watch(channel, cond);
+
+	g_source_set_callback(watch, (GSourceFunc)func, data, NULL);
+	g_source_attach(watch, plugin_data->ingest_context);
+
+	return watch;
+}
+
+void ingest_remove_watch(GSource *watch)
+{
+	g_source_destroy(watch);
+	g_source_unref(watch);
+}
+
+/*
+ * The reminder is due when there's internet access and the user hasn't
+ * registered yet. Both are slow to find out, so the answer is reused for
+ * a while and the GTK main loop only ever reads it.
+ */
+static void check_reminder_due(kano_notifications_t *plugin_data)
+{
+	gint64 now = g_get_monotonic_time();
+
+	if (plugin_data->reminder_checked_at > 0 &&
+	    now - plugin_data->reminder_checked_at <
+	    REMINDER_CHECK_INTERVAL * G_USEC_PER_SEC)
+		return;
+
+	plugin_data->reminder_checked_at = now;
+	g_atomic_int_set(&(plugin_data->reminder_due),
+			 is_internet() && !is_user_registered());
+}
+
+/*
+ * The GTK main loop is so far behind that the hand-off ring is full. Under
+ * the spill-to-disk policy the notification goes straight to the spill
+ * file, otherwise it's the newest one that gets dropped.
+ */
+static ingest_status_t handle_ring_full(kano_notifications_t *plugin_data,
+					notification_info_t *notification)
+{
+	if (plugin_data->conf.overflow_policy == OVERFLOW_SPILL_TO_DISK &&
+	    spill_notification(plugin_data, notification))
+		return INGEST_OK;
+
+	g_mutex_lock(&(plugin_data->lock));
+	plugin_data->overflow.dropped_newest++;
+	g_mutex_unlock(&(plugin_data->lock));
+
+	return INGEST_QUEUE_FULL;
+}
+
+/*
+ * Pass a parsed notification over to the GTK main loop. Must be called
+ * from the ingest thread, the GTK loop is woken up by wake_up_ui().
+ *
+ * The notification is freed unless it was handed over.
+ */
+ingest_status_t hand_off_notification(kano_notifications_t *plugin_data,
+				      notification_info_t *notification)
+{
+	ingest_status_t status;
+	guint pending;
+
+	check_reminder_due(plugin_data);
+
+	/* The conf is only ever changed from this thread. */
+	if (IS_TYPE(notification, "world") &&
+	    !plugin_data->conf.allow_world_notifications) {
+		free_notification(notification);
+		return INGEST_IGNORED;
+	}
+
+	pending = g_atomic_int_get(&(plugin_data->queue_length)) +
+		  spsc_ring_count(&(plugin_data->handoff));
+
+	/* The other overflow policies are applied once it gets to the
+	   queue, there's no point in handing it over if it would be
+	   dropped anyway. Critical ones can still push out a less urgent
+	   one there and coalescible ones can take the place of a waiting
+	   one. With the digest on, the queue can make room by folding
+	   the waiting ones into it, so that's left to the queue too. */
+	if (plugin_data->conf.overflow_policy == OVERFLOW_DROP_NEWEST &&
+	    plugin_data->conf.digest_threshold == 0 &&
+	    notification->urgency < URGENCY_CRITICAL &&
+	    !is_coalescible(plugin_data, notification) &&
+	    pending >= plugin_data->conf.max_queue_len) {
+		g_mutex_lock(&(plugin_data->lock));
+		plugin_data->overflow.dropped_newest++;
+		g_mutex_unlock(&(plugin_data->lock));
+		status = INGEST_QUEUE_FULL;
+	} else if (spsc_ring_push(&(plugin_data->handoff), notification)) {
+		return INGEST_OK;
+	} else {
+		status = handle_ring_full(plugin_data, notification);
+	}
+
+	if (status == INGEST_QUEUE_FULL)
+		plugin_data->stats.queue_full++;
+
+	free_notification(notification);
+
+	return status;
+}
+
+void wake_up_ui(kano_notifications_t *plugin_data)
+{
+	uint64_t one = 1;
+
+	if (write(plugin_data->handoff_fd, &one, sizeof(one)) < 0 &&
+	    errno != EAGAIN)
+		perror("write");
+}
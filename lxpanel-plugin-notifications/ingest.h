@@ -0,0 +1,45 @@
+/*
+ * ingest.h
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * The thread that reads and parses the incoming messages and hands the
+ * notifications over to the GTK main loop.
+ *
+ */
+
+#include <glib.h>
+
+#include "notifications.h"
+
+#ifndef notif_ingest_h
+#define notif_ingest_h
+
+#define HANDOFF_RING_SIZE 256
+
+/* How many lines a source watch takes before letting the others run. */
+#define INGEST_MAX_LINES_PER_WAKEUP 256
+
+/* How many wakeups go by between two reports of the ingest stats. */
+#define INGEST_STATS_INTERVAL 100
+
+/* How often it's checked whether the reminder is due, in seconds. */
+#define REMINDER_CHECK_INTERVAL (5 * 60)
+
+void init_ingest(kano_notifications_t *plugin_data);
+void clear_ingest(kano_notifications_t *plugin_data);
+
+void start_ingest_thread(kano_notifications_t *plugin_data);
+void stop_ingest_thread(kano_notifications_t *plugin_data);
+
+GSource *ingest_add_watch(kano_notifications_t *plugin_data,
+			  GIOChannel *channel, GIOCondition cond,
+			  GIOFunc func, gpointer data);
+void ingest_remove_watch(GSource *watch);
+
+ingest_status_t hand_off_notification(kano_notifications_t *plugin_data,
+				      notification_info_t *notification);
+void wake_up_ui(kano_notifications_t *plugin_data);
+
+#endif
@@ -0,0 +1,355 @@
+/*
+ * journal.c
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * The file starts with a small header followed by the entries, each one
+ * aligned to 8 bytes. An entry is written in place into the mapping and
+ * the header of the next one is zeroed, which marks the end of the
+ * journal. Completing an entry only flips its state, the space is reused
+ * when the journal is compacted.
+ *
+ * Nothing is synced when writing. The pages are written back by the
+ * kernel as usual or explicitly by journal_sync(), which the daemon calls
+ * on a timer, so appending costs about as much as a memcpy.
+ *
+ */
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "journal.h"
+
+
+#define ENTRY_LIVE 1
+#define ENTRY_DONE 2
+
+#define ALIGN(x) (((x) + 7) & ~((gsize)7))
+
+typedef struct {
+	guint32 magic;
+	guint32 reserved;
+} journal_header_t;
+
+typedef struct {
+	guint32 len;	/* length of the message that follows */
+	guint32 state;	/* 0 marks the end of the journal */
+	guint32 seq;
+	guint32 reserved;
+} journal_entry_t;
+
+#define ENTRY_SIZE(len) ALIGN(sizeof(journal_entry_t) + (len))
+
+static journal_entry_t *entry_at(journal_t *journal, gsize offset)
+{
+	return (journal_entry_t *)(journal->map + offset);
+}
+
+/*
+ * Check whether there's a valid entry at offset.
+ */
+static gboolean is_entry(journal_t *journal, gsize offset)
+{
+	journal_entry_t *entry;
+
+	if (offset + sizeof(journal_entry_t) > journal->size)
+		return FALSE;
+
+	entry = entry_at(journal, offset);
+
+	return (entry->state == ENTRY_LIVE || entry->state == ENTRY_DONE) &&
+	       entry->len <= journal->size - offset &&
+	       ENTRY_SIZE(entry->len) <= journal->size - offset;
+}
+
+/*
+ * Zero the header at the end of the journal, if there's room for one.
+ */
+static void terminate(journal_t *journal)
+{
+	if (journal->used + sizeof(journal_entry_t) <= journal->size)
+		memset(entry_at(journal, journal->used), 0,
+		       sizeof(journal_entry_t));
+}
+
+static gboolean journal_map(journal_t *journal, gsize size)
+{
+	if (journal->map)
+		munmap(journal->map, journal->size);
+
+	journal->map = NULL;
+
+	if (ftruncate(journal->fd, size) < 0) {
+		perror("ftruncate");
+		return FALSE;
+	}
+
+	journal->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			    journal->fd, 0);
+	if (journal->map == MAP_FAILED) {
+		perror("mmap");
+		journal->map = NULL;
+		return FALSE;
+	}
+
+	journal->size = size;
+	return TRUE;
+}
+
+/*
+ * Open the journal at path, creating it if needed, and work out where
+ * the existing entries end.
+ */
+gboolean journal_open(journal_t *journal, const gchar *path)
+{
+	journal_header_t *header;
+	journal_entry_t *entry;
+	struct stat st;
+	gsize offset;
+
+	journal->map = NULL;
+	journal->size = 0;
+	journal->used = sizeof(journal_header_t);
+	journal->dead = 0;
+	journal->next_seq = 1;
+	journal->dirty = FALSE;
+	journal->offsets = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	journal->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC,
+			   S_IRUSR | S_IWUSR);
+	if (journal->fd < 0) {
+		perror("open");
+		return FALSE;
+	}
+
+	if (fstat(journal->fd, &st) < 0 ||
+	    !journal_map(journal, MAX((gsize)st.st_size, JOURNAL_INITIAL_SIZE))) {
+		journal_close(journal);
+		return FALSE;
+	}
+
+	/* Start from scratch if this isn't a journal we know. */
+	header = (journal_header_t *)journal->map;
+	if (header->magic != JOURNAL_MAGIC) {
+		memset(journal->map, 0, journal->size);
+		header->magic = JOURNAL_MAGIC;
+		return TRUE;
+	}
+
+	/* The journal ends at the first entry that doesn't make sense,
+	   anything after it is overwritten by the next append. */
+	for (offset = journal->used; is_entry(journal, offset);
+	     offset += ENTRY_SIZE(entry->len)) {
+		entry = entry_at(journal, offset);
+
+		if (entry->state == ENTRY_LIVE)
+			g_hash_table_insert(journal->offsets,
+					    GUINT_TO_POINTER(entry->seq),
+					    GSIZE_TO_POINTER(offset));
+		else
+			journal->dead += ENTRY_SIZE(entry->len);
+
+		if (entry->seq >= journal->next_seq)
+			journal->next_seq = entry->seq + 1;
+	}
+
+	journal->used = offset;
+	terminate(journal);
+
+	return TRUE;
+}
+
+void journal_close(journal_t *journal)
+{
+	if (journal->map) {
+		msync(journal->map, journal->size, MS_SYNC);
+		munmap(journal->map, journal->size);
+		journal->map = NULL;
+	}
+
+	if (journal->fd >= 0)
+		close(journal->fd);
+	journal->fd = -1;
+
+	if (journal->offsets)
+		g_hash_table_destroy(journal->offsets);
+	journal->offsets = NULL;
+}
+
+/*
+ * Record a message in the journal.
+ *
+ * Returns the sequence number that identifies the entry or 0 if it
+ * couldn't be written.
+ */
+guint32 journal_append(journal_t *journal, const gchar *msg, gsize len)
+{
+	journal_entry_t *entry;
+	gsize needed = journal->used + ENTRY_SIZE(len) + sizeof(journal_entry_t);
+	gsize size = journal->size;
+	gsize offset;
+
+	if (!journal->map || len > G_MAXUINT32)
+		return 0;
+
+	if (needed > size) {
+		while (needed > size)
+			size *= 2;
+
+		if (!journal_map(journal, size))
+			return 0;
+	}
+
+	offset = journal->used;
+	entry = entry_at(journal, offset);
+	entry->len = len;
+	entry->seq = journal->next_seq++;
+	entry->reserved = 0;
+	memcpy(entry + 1, msg, len);
+
+	journal->used += ENTRY_SIZE(len);
+	terminate(journal);
+
+	/* The entry only counts once it's been written completely. */
+	entry->state = ENTRY_LIVE;
+	journal->dirty = TRUE;
+
+	g_hash_table_insert(journal->offsets, GUINT_TO_POINTER(entry->seq),
+			    GSIZE_TO_POINTER(offset));
+
+	return entry->seq;
+}
+
+/*
+ * Squeeze the completed entries out by moving the live ones to the front.
+ */
+static void journal_compact(journal_t *journal)
+{
+	journal_entry_t *entry;
+	gsize from, to, size;
+
+	to = sizeof(journal_header_t);
+
+	for (from = to; from < journal->used; from += size) {
+		entry = entry_at(journal, from);
+		size = ENTRY_SIZE(entry->len);
+
+		if (entry->state != ENTRY_LIVE)
+			continue;
+
+		if (from != to) {
+			memmove(journal->map + to, entry, size);
+			g_hash_table_insert(journal->offsets,
+					    GUINT_TO_POINTER(entry_at(journal, to)->seq),
+					    GSIZE_TO_POINTER(to));
+		}
+
+		to += size;
+	}
+
+	journal->used = to;
+	journal->dead = 0;
+	journal->dirty = TRUE;
+	terminate(journal);
+}
+
+/*
+ * Mark an entry as done with, it won't be replayed anymore.
+ */
+void journal_complete(journal_t *journal, guint32 seq)
+{
+	journal_entry_t *entry;
+	gpointer offset;
+
+	if (!journal->map || seq == 0 ||
+	    !g_hash_table_lookup_extended(journal->offsets,
+					  GUINT_TO_POINTER(seq), NULL, &offset))
+		return;
+
+	g_hash_table_remove(journal->offsets, GUINT_TO_POINTER(seq));
+
+	entry = entry_at(journal, GPOINTER_TO_SIZE(offset));
+	entry->state = ENTRY_DONE;
+	journal->dead += ENTRY_SIZE(entry->len);
+	journal->dirty = TRUE;
+
+	/* Nothing is live, so the whole journal can be reused. */
+	if (g_hash_table_size(journal->offsets) == 0) {
+		journal->used = sizeof(journal_header_t);
+		journal->dead = 0;
+		terminate(journal);
+		return;
+	}
+
+	if (journal->dead >= JOURNAL_COMPACT_MIN &&
+	    journal->dead > (journal->used - sizeof(journal_header_t)) / 2)
+		journal_compact(journal);
+}
+
+/*
+ * Call fn for every live entry in the order they were appended. It's
+ * fine for fn to complete the entry it's given.
+ *
+ * The message passed to fn isn't NUL terminated.
+ */
+void journal_replay(journal_t *journal, journal_replay_fn fn, gpointer data)
+{
+	journal_entry_t *entry;
+	GArray *seqs;
+	gpointer offset;
+	gsize pos;
+	guint i;
+
+	if (!journal->map)
+		return;
+
+	/* Completing entries may compact the journal, so only the sequence
+	   numbers are collected up front. */
+	seqs = g_array_new(FALSE, FALSE, sizeof(guint32));
+
+	for (pos = sizeof(journal_header_t); pos < journal->used;
+	     pos += ENTRY_SIZE(entry->len)) {
+		entry = entry_at(journal, pos);
+
+		if (entry->state == ENTRY_LIVE)
+			g_array_append_val(seqs, entry->seq);
+	}
+
+	for (i = 0; i < seqs->len; i++) {
+		guint32 seq = g_array_index(seqs, guint32, i);
+
+		if (!g_hash_table_lookup_extended(journal->offsets,
+						  GUINT_TO_POINTER(seq),
+						  NULL, &offset))
+			continue;
+
+		entry = entry_at(journal, GPOINTER_TO_SIZE(offset));
+		fn(seq, (const gchar *)(entry + 1), entry->len, data);
+	}
+
+	g_array_free(seqs, TRUE);
+}
+
+/*
+ * Write the changes back to the file. Only waits for the write to finish
+ * if asked to.
+ */
+void journal_sync(journal_t *journal, gboolean wait)
+{
+	if (!journal->map || !journal->dirty)
+		return;
+
+	if (msync(journal->map, journal->size, wait ? MS_SYNC : MS_ASYNC) < 0)
+		perror("msync");
+
+	journal->dirty = FALSE;
+}
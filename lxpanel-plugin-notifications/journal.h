@@ -0,0 +1,48 @@
+/*
+ * journal.h
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * An append-only, memory-mapped record of the notifications that were
+ * queued but not displayed yet, so they survive a restart of the daemon.
+ *
+ */
+
+#include <glib.h>
+
+#ifndef notif_journal_h
+#define notif_journal_h
+
+#define JOURNAL_MAGIC 0x314a4e4b /* "KNJ1" */
+#define JOURNAL_INITIAL_SIZE (64 * 1024)
+
+/* Completed entries are only squeezed out once they take up at least
+   this much and more than half of the journal. */
+#define JOURNAL_COMPACT_MIN (16 * 1024)
+
+typedef struct {
+	int fd;
+	guint8 *map;
+	gsize size;	/* size of the file and the mapping */
+	gsize used;	/* end of the last entry */
+	gsize dead;	/* bytes taken up by completed entries */
+
+	guint32 next_seq;
+	GHashTable *offsets; /* seq -> offset of every live entry */
+
+	gboolean dirty;	/* written since the last sync */
+} journal_t;
+
+typedef void (*journal_replay_fn)(guint32 seq, const gchar *msg, gsize len,
+				  gpointer data);
+
+gboolean journal_open(journal_t *journal, const gchar *path);
+void journal_close(journal_t *journal);
+
+guint32 journal_append(journal_t *journal, const gchar *msg, gsize len);
+void journal_complete(journal_t *journal, guint32 seq);
+void journal_replay(journal_t *journal, journal_replay_fn fn, gpointer data);
+void journal_sync(journal_t *journal, gboolean wait);
+
+#endif
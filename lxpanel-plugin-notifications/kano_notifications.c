@@ -23,69 +23,85 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <pwd.h>
+#include <errno.h>
+#include <sys/socket.h>
 
 #include "parson/parson.h"
 #include "config.h"
 #include "notifications.h"
 #include "ui.h"
+#include "server.h"
+#include "ingest.h"
+#include "queue.h"
+#include "backlog.h"
+#include "rules.h"
+#include "prefixes.h"
+#include "control.h"
 
 
-#define CHEER_SOUND "/usr/share/kano-media/sounds/kano_level_up.wav"
-
-#define MAX_QUEUE_LEN 50
-
 #define __STR_HELPER(x) #x
 #define STR(x) __STR_HELPER(x)
 
-#define LEVEL_IMG_BASE_PATH ("/usr/share/kano-profile/media/images/%s/" \
-	STR(NOTIFICATION_IMAGE_WIDTH)  "x" STR(NOTIFICATION_IMAGE_HEIGHT) \
-		"/Level-%s.png")
-#define AWARD_IMG_BASE_PATH ("/usr/share/kano-profile/media/images/%s/" \
-	STR(NOTIFICATION_IMAGE_WIDTH) "x" STR(NOTIFICATION_IMAGE_HEIGHT) \
-	"/%s/%s_levelup.png")
 #define WORLD_IMG_BASE_PATH ("/usr/share/kano-profile/media/images/notification/" \
 	STR(NOTIFICATION_IMAGE_WIDTH)  "x" STR(NOTIFICATION_IMAGE_HEIGHT) \
 	"/notification.png")
 
-#define LEVEL_TITLE "New level!"
-#define LEVEL_BYLINE "You're now Level %s"
-
-#define BADGE_TITLE "New badge!"
-#define ENV_TITLE "New environment!"
-#define AVATAR_TITLE "New avatar!"
-
-#define RULES_BASE_PATH "/usr/share/kano-profile/rules/%s/%s.json"
-
-#define KANO_PROFILE_CMD "kano-profile-gui"
-#define KANO_LOGIN_CMD "kano-login 3"
-
 static gboolean io_watch_cb(GIOChannel *source, GIOCondition cond, gpointer data);
 
 static void cleanup(gpointer data);
 
 /*
- * Main body - does initialisation, most actual work runs in io_watch_cb.
+ * Main body - does initialisation, most actual work runs in io_watch_cb
+ * on the ingest thread.
  *
  */
 int main(int argc, char *argv[])
 {
 	/* allocate our private structure instance */
 	kano_notifications_t *plugin_data = g_new0(kano_notifications_t, 1);
+	guint i;
 
 	plugin_data->panel_height = 44; //FIXME - make this configurable
 	gtk_init (&argc, &argv);
 
+	init_rules_cache();
+	init_prefixes();
+
 
-	plugin_data->window = NULL;
-	plugin_data->queue = NULL;
+	for (i = 0; i < MAX_STACK_SIZE; i++)
+		plugin_data->slots[i].plugin_data = plugin_data;
+	plugin_data->fingerprints = g_hash_table_new(g_int64_hash, g_int64_equal);
+	plugin_data->categories = g_hash_table_new(g_str_hash, g_str_equal);
 
 	plugin_data->paused = FALSE; /* TODO load from the configuration */
 
 	g_mutex_init(&(plugin_data->lock));
 
+	load_conf(&(plugin_data->conf));
+
+	/* Room for the reminder too, they only grow past that if the
+	   limit is raised later on. */
+	for (i = 0; i < N_URGENCIES; i++)
+		deque_init(&(plugin_data->queues[i]),
+			   plugin_data->conf.max_queue_len + 1);
+
+	init_ingest(plugin_data);
+	init_spill(plugin_data);
+
+	init_reminder(plugin_data);
+	init_digest(plugin_data);
+
+	/* Restore the queue before anything new can arrive. */
+	init_journal(plugin_data);
+	init_expiry(plugin_data);
+
 	/* Create the pipe file */
 	gchar *pipe_filename=get_fifo_filename();
 	if (pipe_filename) {
+		/* Messages written while the daemon wasn't running ended up
+		   in a regular file, keep it for recover_backlog() */
+		stash_backlog(pipe_filename);
+
 		/* remove previous instance of the pipe */
 		unlink(pipe_filename);
 
@@ -100,22 +116,38 @@ int main(int argc, char *argv[])
 			chmod (pipe_filename, 0666);
 		}
 
-		plugin_data->fifo_fd = open(pipe_filename, O_RDWR | O_NONBLOCK,
+		plugin_data->fifo.fd = open(pipe_filename, O_RDWR | O_NONBLOCK,
 					    0);
-		if (plugin_data->fifo_fd < 0) {
+		if (plugin_data->fifo.fd < 0) {
 			perror("open");
 			return 0;
 		}
 
-		/* Start watching the pipe for input. */
-		plugin_data->fifo_channel = g_io_channel_unix_new(plugin_data->fifo_fd);
-		plugin_data->watch_id = g_io_add_watch(plugin_data->fifo_channel,
-						       G_IO_IN, (GIOFunc)io_watch_cb,
-						       (gpointer)plugin_data);
+		/* Nobody can be replied to through the pipe. */
+		plugin_data->fifo.reply_fd = -1;
+		plugin_data->fifo.ack = FALSE;
+
+		/* Start watching the pipe for input. The data is read from
+		   the fd directly, the channel is only used for the watch. */
+		msgbuf_init(&(plugin_data->fifo.buf),
+			    plugin_data->conf.max_message_size);
+		plugin_data->fifo_channel = g_io_channel_unix_new(plugin_data->fifo.fd);
+		plugin_data->fifo_watch = ingest_add_watch(plugin_data,
+							   plugin_data->fifo_channel,
+							   G_IO_IN, (GIOFunc)io_watch_cb,
+							   (gpointer)plugin_data);
 		g_free(pipe_filename);
 	}
 
-	load_conf(&(plugin_data->conf));
+	/* Producers that want to keep a connection open or get replies
+	   use the socket instead. The pipe keeps working without it. */
+	start_server(plugin_data);
+
+	start_ingest_thread(plugin_data);
+
+	/* Pick up whatever was left on disk by the previous run. */
+	request_unspill(plugin_data);
+	recover_backlog(plugin_data);
 
 	gtk_main ();
 
@@ -131,11 +163,34 @@ static void cleanup(gpointer data)
 {
 
 	kano_notifications_t *plugin_data = (kano_notifications_t *)data;
+	guint i;
 
-	g_source_remove(plugin_data->watch_id);
+	/* This still needs the ingest thread and the spill file. */
+	close_notification(plugin_data);
+
+	stop_ingest_thread(plugin_data);
+
+	ingest_remove_watch(plugin_data->fifo_watch);
 	g_io_channel_shutdown(plugin_data->fifo_channel, FALSE, NULL);
 	g_io_channel_unref(plugin_data->fifo_channel);
-	close(plugin_data->fifo_fd);
+	close(plugin_data->fifo.fd);
+	msgbuf_clear(&(plugin_data->fifo.buf));
+
+	stop_server(plugin_data);
+
+	clear_ingest(plugin_data);
+	clear_spill(plugin_data);
+	clear_expiry(plugin_data);
+	clear_journal(plugin_data);
+	clear_reminder(plugin_data);
+	clear_digest(plugin_data);
+	g_hash_table_destroy(plugin_data->fingerprints);
+	g_hash_table_destroy(plugin_data->categories);
+	g_strfreev(plugin_data->conf.coalesce_categories);
+	for (i = 0; i < N_URGENCIES; i++)
+		deque_clear(&(plugin_data->queues[i]));
+	clear_prefixes();
+	clear_rules_cache();
 
 	gchar *pipe_filename=get_fifo_filename();
 	if (pipe_filename) {
@@ -143,210 +198,259 @@ static void cleanup(gpointer data)
 		g_free(pipe_filename);
 	}
 
-	close_notification(plugin_data);
-
 	g_mutex_clear(&(plugin_data->lock));
 
 	g_free(plugin_data);
 }
 
 /*
- * Parse the byline from the JSON file that represents the award
- * (badges, environments, avatars)
+ * The strings of a notification. They are all copied into the block of
+ * the notification by pack_notification(). All of them but the first
+ * one make up its fingerprint.
  */
-static void get_award_byline(gchar *json_file, gchar *key,
-			     notification_info_t *notification)
-{
-	JSON_Value *root_value = NULL;
-	JSON_Object *root = NULL;
-	JSON_Object *award = NULL;
-	const char *byline = NULL;
+static const glong notification_strings[] = {
+	G_STRUCT_OFFSET(notification_info_t, unparsed),
+	G_STRUCT_OFFSET(notification_info_t, title),
+	G_STRUCT_OFFSET(notification_info_t, byline),
+	G_STRUCT_OFFSET(notification_info_t, type),
+	G_STRUCT_OFFSET(notification_info_t, category),
+	G_STRUCT_OFFSET(notification_info_t, image_path),
+	G_STRUCT_OFFSET(notification_info_t, command),
+	G_STRUCT_OFFSET(notification_info_t, sound),
+	G_STRUCT_OFFSET(notification_info_t, button1_label),
+	G_STRUCT_OFFSET(notification_info_t, button1_command),
+	G_STRUCT_OFFSET(notification_info_t, button1_colour),
+	G_STRUCT_OFFSET(notification_info_t, button1_hover),
+	G_STRUCT_OFFSET(notification_info_t, button2_label),
+	G_STRUCT_OFFSET(notification_info_t, button2_command),
+	G_STRUCT_OFFSET(notification_info_t, button2_colour),
+	G_STRUCT_OFFSET(notification_info_t, button2_hover),
+};
+
+#define FNV_OFFSET_BASIS G_GUINT64_CONSTANT(0xcbf29ce484222325)
+#define FNV_PRIME G_GUINT64_CONSTANT(0x100000001b3)
 
-	notification->byline = NULL;
+/*
+ * Fold a string into a 64-bit FNV-1a hash, including its terminating
+ * null byte so "ab", "c" and "a", "bc" hash differently. A missing
+ * string hashes differently from an empty one.
+ */
+static guint64 fingerprint_string(guint64 hash, const gchar *value)
+{
+	const guchar *pos = (const guchar *)value;
 
-	root_value = json_parse_file(json_file);
-	if (json_value_get_type(root_value) != JSONObject) {
-		json_value_free(root_value);
-		return;
-	}
+	if (!value)
+		return (hash ^ 0xff) * FNV_PRIME;
 
-	root = json_value_get_object(root_value);
-	award = json_object_get_object(root, key);
-	if (!award) {
-		json_value_free(root_value);
-		return;
-	}
-
-	byline = json_object_get_string(award, "title");
-	if (!byline) {
-		json_value_free(root_value);
-		return;
-	}
+	do {
+		hash = (hash ^ *pos) * FNV_PRIME;
+	} while (*pos++);
 
-	notification->byline = g_new0(gchar, strlen(byline) + 1);
-	g_strlcpy(notification->byline, byline, strlen(byline) + 1);
-	json_value_free(root_value);
+	return hash;
 }
 
-
 /*
- * Determine the appropriate command for an award notification based
- * on whether the user is logged in to kano world or not.
+ * The fingerprint of a raw message, for telling repeated ones apart
+ * before they are parsed.
  */
-static void set_award_command(notification_info_t *notification)
+guint64 fingerprint_message(const gchar *msg)
 {
-	ssize_t len;
-	if (is_user_registered()) {
-		len = strlen(KANO_PROFILE_CMD);
-		notification->command = g_new0(gchar, len + 2);
-		g_strlcpy(notification->command, KANO_PROFILE_CMD, len);
-	} else {
-		len = strlen(KANO_LOGIN_CMD);
-		notification->command = g_new0(gchar, len + 2);
-		g_strlcpy(notification->command, KANO_LOGIN_CMD, len + 2);
-	}
+	return fingerprint_string(FNV_OFFSET_BASIS, msg);
 }
 
-
 /*
- * Prepare a notification_t instance to be displayed based on an id
- * for it. The format of the id is the following:
+ * Allocate a notification as a single block and copy the draft into it.
  *
- *  - badges:application:feedbacker
- *  - avatars:conductor:conductor_1
+ * The strings of the draft are only borrowed. The block is sized first,
+ * then they are packed one after the other right behind the struct, so
+ * the notification can be freed with a single g_free() and its fields
+ * sit next to each other in memory.
  *
- * TODO: Now that the widget supports JSON notifications, this logic
- *       could be moved outside of the widget itself.
+ * The fingerprint of the content is worked out on the way, so spotting
+ * duplicates later on doesn't have to compare the strings.
  */
-static notification_info_t *get_notification_by_id(gchar *id, gboolean free_unparsed)
+notification_info_t *pack_notification(const notification_info_t *draft)
 {
-	gchar **tokens = g_strsplit(id, ":", 0);
-	gchar **iter;
-	size_t bufsize = 0;
-
-	size_t length = 0;
-	for (iter = tokens; *iter; iter++)
-		length++;
-
-	if (length < 1) {
-		g_strfreev(tokens);
-		return NULL;
+	gsize lengths[G_N_ELEMENTS(notification_strings)];
+	gsize size = sizeof(notification_info_t);
+	guint64 fingerprint = FNV_OFFSET_BASIS;
+	notification_info_t *data;
+	const gchar *value;
+	gchar *pos;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(notification_strings); i++) {
+		value = G_STRUCT_MEMBER(gchar *, draft, notification_strings[i]);
+		lengths[i] = value ? strlen(value) + 1 : 0;
+		size += lengths[i];
+
+		if (i > 0)
+			fingerprint = fingerprint_string(fingerprint, value);
 	}
 
-	if (g_strcmp0(tokens[0], "level") == 0) {
-		if (length < 2) {
-			g_strfreev(tokens);
-			return NULL;
-		}
-
-		notification_info_t *data = g_new0(notification_info_t, 1);
+	data = g_malloc(size);
+	*data = *draft;
+	data->size = size;
+	data->fingerprint = fingerprint;
 
-		/* pass ownership of the input */
-		data->free_unparsed = free_unparsed;
-		data->unparsed = id;
+	pos = (gchar *)(data + 1);
+	for (i = 0; i < G_N_ELEMENTS(notification_strings); i++) {
+		if (lengths[i] == 0)
+			continue;
 
-		/* Allocate and set the title */
-		bufsize = strlen(LEVEL_TITLE);
-		data->title = g_new0(gchar, bufsize+1);
-		g_strlcpy(data->title, LEVEL_TITLE, bufsize+1);
-
-		/* Allocate and set the byline */
-		bufsize = strlen(LEVEL_BYLINE) + strlen(tokens[1]);
-		data->byline = g_new0(gchar, bufsize+1);
-		g_sprintf(data->byline, LEVEL_BYLINE, tokens[1]);
+		value = G_STRUCT_MEMBER(gchar *, draft, notification_strings[i]);
+		memcpy(pos, value, lengths[i]);
+		G_STRUCT_MEMBER(gchar *, data, notification_strings[i]) = pos;
+		pos += lengths[i];
+	}
 
-		/* Allocate and set image_path */
-		bufsize += strlen(LEVEL_IMG_BASE_PATH);
-		bufsize += strlen(tokens[0]) + strlen(tokens[1]);
-		data->image_path = g_new0(gchar, bufsize+1);
-		g_sprintf(data->image_path, LEVEL_IMG_BASE_PATH,
-			  tokens[0], tokens[1]);
+	return data;
+}
 
-		/* Allocate and set the sound */
-		bufsize = strlen(CHEER_SOUND);
-		data->sound = g_new0(gchar, bufsize+1);
-		g_strlcpy(data->sound, CHEER_SOUND, bufsize+1);
 
-		g_strfreev(tokens);
-		return data;
-	}
+/*
+ * The keys of a JSON notification and where their values go.
+ */
+typedef enum {
+	JSON_FIELD_NONE = -1,
+	JSON_FIELD_TITLE,
+	JSON_FIELD_BYLINE,
+	JSON_FIELD_IMAGE,
+	JSON_FIELD_COMMAND,
+	JSON_FIELD_SOUND,
+	JSON_FIELD_TYPE,
+	JSON_FIELD_BUTTON1_LABEL,
+	JSON_FIELD_BUTTON1_COLOUR,
+	JSON_FIELD_BUTTON1_HOVER,
+	JSON_FIELD_BUTTON1_COMMAND,
+	JSON_FIELD_BUTTON2_LABEL,
+	JSON_FIELD_BUTTON2_COLOUR,
+	JSON_FIELD_BUTTON2_HOVER,
+	JSON_FIELD_BUTTON2_COMMAND,
+	JSON_FIELD_URGENCY,
+	JSON_FIELD_CATEGORY,
+	JSON_FIELD_TTL,
+	JSON_FIELD_EXPIRES_AT,
+	JSON_FIELD_TIMEOUT,
+	N_JSON_FIELDS
+} json_field_t;
+
+struct json_field {
+	const gchar *key;
+	glong offset;		/* of the member in notification_info_t */
+	json_field_t needs;	/* only kept if this one is set too */
+	gsize number;		/* the size of an integer member, 0 for strings */
+	gint64 min, max;	/* numbers are clamped to these */
+};
+
+#define JSON_FIELD(key, member, needs) \
+	{ key, G_STRUCT_OFFSET(notification_info_t, member), needs, 0, 0, 0 }
+
+#define JSON_NUMBER_FIELD(key, member, min, max) \
+	{ key, G_STRUCT_OFFSET(notification_info_t, member), JSON_FIELD_NONE, \
+	  sizeof(((notification_info_t *)NULL)->member), min, max }
+
+static const struct json_field json_fields[N_JSON_FIELDS] = {
+	[JSON_FIELD_TITLE] = JSON_FIELD("title", title, JSON_FIELD_NONE),
+	[JSON_FIELD_BYLINE] = JSON_FIELD("byline", byline, JSON_FIELD_NONE),
+	[JSON_FIELD_IMAGE] = JSON_FIELD("image", image_path, JSON_FIELD_NONE),
+	[JSON_FIELD_COMMAND] = JSON_FIELD("command", command, JSON_FIELD_NONE),
+	[JSON_FIELD_SOUND] = JSON_FIELD("sound", sound, JSON_FIELD_NONE),
+	[JSON_FIELD_TYPE] = JSON_FIELD("type", type, JSON_FIELD_NONE),
+	[JSON_FIELD_BUTTON1_LABEL] = JSON_FIELD("button1_label", button1_label,
+						JSON_FIELD_NONE),
+	[JSON_FIELD_BUTTON1_COLOUR] = JSON_FIELD("button1_colour", button1_colour,
+						 JSON_FIELD_BUTTON1_LABEL),
+	[JSON_FIELD_BUTTON1_HOVER] = JSON_FIELD("button1_hover", button1_hover,
+						JSON_FIELD_BUTTON1_LABEL),
+	[JSON_FIELD_BUTTON1_COMMAND] = JSON_FIELD("button1_command", button1_command,
+						  JSON_FIELD_BUTTON1_LABEL),
+	[JSON_FIELD_BUTTON2_LABEL] = JSON_FIELD("button2_label", button2_label,
+						JSON_FIELD_NONE),
+	[JSON_FIELD_BUTTON2_COLOUR] = JSON_FIELD("button2_colour", button2_colour,
+						 JSON_FIELD_BUTTON2_LABEL),
+	[JSON_FIELD_BUTTON2_HOVER] = JSON_FIELD("button2_hover", button2_hover,
+						JSON_FIELD_BUTTON2_LABEL),
+	[JSON_FIELD_BUTTON2_COMMAND] = JSON_FIELD("button2_command", button2_command,
+						  JSON_FIELD_BUTTON2_LABEL),
+	[JSON_FIELD_URGENCY] = JSON_NUMBER_FIELD("urgency", urgency,
+						 URGENCY_LOW, URGENCY_CRITICAL),
+	[JSON_FIELD_CATEGORY] = JSON_FIELD("category", category, JSON_FIELD_NONE),
+	[JSON_FIELD_TTL] = JSON_NUMBER_FIELD("ttl", ttl, 0, G_MAXINT),
+	[JSON_FIELD_EXPIRES_AT] = JSON_NUMBER_FIELD("expires_at", expires_at,
+						    0, G_MAXUINT32),
+	[JSON_FIELD_TIMEOUT] = JSON_NUMBER_FIELD("timeout", timeout, 0, 3600),
+};
 
-	/* badge, environment, or avatar */
-	if (length < 3) {
-		g_strfreev(tokens);
-		return NULL;
-	}
+/*
+ * A perfect hash of the keys above, every key lands in its own slot out
+ * of 32. So a lookup costs one hash and at most one string comparison.
+ * Any change to the keys needs new factors and a new slot table.
+ */
+#define JSON_FIELD_HASH_SIZE 32
 
-	notification_info_t *data = g_new0(notification_info_t, 1);
-
-	/* pass ownership of the input */
-	data->free_unparsed = free_unparsed;
-	data->unparsed = id;
-
-	if (g_strcmp0(tokens[0], "badges") == 0) {
-		/* Allocate and set the title */
-		bufsize = strlen(BADGE_TITLE);
-		data->title = g_new0(gchar, bufsize+1);
-		g_strlcpy(data->title, BADGE_TITLE, bufsize+1);
-	} else if (g_strcmp0(tokens[0], "environments") == 0) {
-		/* Allocate and set the title */
-		bufsize = strlen(ENV_TITLE);
-		data->title = g_new0(gchar, bufsize+1);
-		g_strlcpy(data->title, ENV_TITLE, bufsize+1);
-	} else if (g_strcmp0(tokens[0], "avatars") == 0) {
-		/* Allocate and set the title */
-		bufsize = strlen(AVATAR_TITLE);
-		data->title = g_new0(gchar, bufsize+1);
-		g_strlcpy(data->title, AVATAR_TITLE, bufsize+1);
-	} else {
-		g_strfreev(tokens);
-		free_notification(data);
-		return NULL;
-	}
+static guint hash_json_key(const gchar *key, gsize len)
+{
+	guint hash = (guchar)key[0] + (guchar)key[len - 1] * 17 + len * 29;
 
-	/* Allocate and set json rules path */
-	bufsize = strlen(RULES_BASE_PATH);
-	bufsize += strlen(tokens[0]) + strlen(tokens[1]);
-	gchar *json_path = g_new0(gchar, bufsize+1);
-	g_sprintf(json_path, RULES_BASE_PATH, tokens[0], tokens[1]);
+	/* Tells button1 from button2. */
+	if (len > 6)
+		hash += (guchar)key[6];
 
+	return hash % JSON_FIELD_HASH_SIZE;
+}
 
-	/* Load award title */
-	get_award_byline(json_path, tokens[2], data);
-	g_free(json_path);
+static const json_field_t json_field_slots[JSON_FIELD_HASH_SIZE] = {
+	[0] = JSON_FIELD_NONE,
+	[1] = JSON_FIELD_NONE,
+	[2] = JSON_FIELD_URGENCY,
+	[3] = JSON_FIELD_NONE,
+	[4] = JSON_FIELD_NONE,
+	[5] = JSON_FIELD_BYLINE,
+	[6] = JSON_FIELD_CATEGORY,
+	[7] = JSON_FIELD_TIMEOUT,
+	[8] = JSON_FIELD_SOUND,
+	[9] = JSON_FIELD_NONE,
+	[10] = JSON_FIELD_BUTTON1_COMMAND,
+	[11] = JSON_FIELD_BUTTON2_COMMAND,
+	[12] = JSON_FIELD_NONE,
+	[13] = JSON_FIELD_NONE,
+	[14] = JSON_FIELD_EXPIRES_AT,
+	[15] = JSON_FIELD_IMAGE,
+	[16] = JSON_FIELD_NONE,
+	[17] = JSON_FIELD_NONE,
+	[18] = JSON_FIELD_NONE,
+	[19] = JSON_FIELD_NONE,
+	[20] = JSON_FIELD_NONE,
+	[21] = JSON_FIELD_NONE,
+	[22] = JSON_FIELD_COMMAND,
+	[23] = JSON_FIELD_TTL,
+	[24] = JSON_FIELD_BUTTON1_LABEL,
+	[25] = JSON_FIELD_BUTTON2_LABEL,
+	[26] = JSON_FIELD_TITLE,
+	[27] = JSON_FIELD_BUTTON1_COLOUR,
+	[28] = JSON_FIELD_BUTTON2_COLOUR,
+	[29] = JSON_FIELD_TYPE,
+	[30] = JSON_FIELD_BUTTON1_HOVER,
+	[31] = JSON_FIELD_BUTTON2_HOVER,
+};
 
-	if (!data->byline) {
-		free_notification(data);
-		g_strfreev(tokens);
-		return NULL;
-	}
+/*
+ * Returns the field for a key, or JSON_FIELD_NONE if it's not known.
+ */
+static json_field_t lookup_json_field(const gchar *key)
+{
+	json_field_t field;
+	gsize len = strlen(key);
 
-	set_award_command(data);
-
-	/* Allocate and set image_path */
-	if (g_strcmp0(tokens[0], "avatars") == 0) {
-		/* There's a path exception for avatars, handle it here. */
-		bufsize = strlen(AWARD_IMG_BASE_PATH);
-		bufsize += strlen(tokens[0]) + 2*strlen(tokens[1]);
-		data->image_path = g_new0(gchar, bufsize+1);
-		g_sprintf(data->image_path, AWARD_IMG_BASE_PATH,
-			  tokens[0], tokens[1], tokens[1]);
-	} else {
-		bufsize = strlen(AWARD_IMG_BASE_PATH);
-		bufsize += strlen(tokens[0]) + strlen(tokens[1]) +
-				  strlen(tokens[2]);
-		data->image_path = g_new0(gchar, bufsize+1);
-		g_sprintf(data->image_path, AWARD_IMG_BASE_PATH,
-			  tokens[0], tokens[1], tokens[2]);
-	}
+	if (len == 0)
+		return JSON_FIELD_NONE;
 
-	/* Allocate and set the sound */
-	bufsize = strlen(CHEER_SOUND);
-	data->sound = g_new0(gchar, bufsize+1);
-	g_strlcpy(data->sound, CHEER_SOUND, bufsize+1);
+	field = json_field_slots[hash_json_key(key, len)];
+	if (field == JSON_FIELD_NONE || strcmp(json_fields[field].key, key) != 0)
+		return JSON_FIELD_NONE;
 
-	g_strfreev(tokens);
-	return data;
+	return field;
 }
 
 /*
@@ -360,28 +464,34 @@ static notification_info_t *get_notification_by_id(gchar *id, gboolean free_unpa
  *     "sound": "/path/to/a/wav-file.wav",
  *     "command": "lxterminal",
  *     "type": "normal",
+ *     "urgency": 1,
+ *     "category": "level",
+ *     "ttl": 600,
+ *     "timeout": 30
  * }
  *
- * All keys except the title and byline are optional.
+ * All keys except the title and byline are optional, see json_fields
+ * for the full list. Unknown keys are ignored.
+ *
+ * The ttl is in seconds from now, "expires_at" can be used instead to
+ * give the time in seconds since the epoch. The timeout replaces on_time
+ * for this notification, see get_display_time_unsafe().
  */
-notification_info_t *get_json_notification(gchar *json_data, gboolean free_unparsed)
+notification_info_t *get_json_notification(const gchar *json_data)
 {
 	JSON_Value *root_value = NULL;
 	JSON_Object *root = NULL;
-	const char *title = NULL,
-		   *byline = NULL,
-		   *image_path = NULL,
-		   *command = NULL,
-		   *sound = NULL,
-		   *type = NULL,
-		   *button1_label = NULL,
-		   *button1_colour = NULL,
-		   *button1_command = NULL,
-		   *button1_hover = NULL,
-		   *button2_label = NULL,
-		   *button2_colour = NULL,
-		   *button2_command = NULL,
-		   *button2_hover = NULL;
+	notification_info_t draft = { 0 };
+	notification_info_t *data;
+	JSON_Value *values[N_JSON_FIELDS] = { NULL };
+	const gchar *name;
+	gsize i, count;
+	json_field_t field;
+	gdouble number;
+
+	/* Don't bother parsing what can't have the mandatory fields. */
+	if (!strstr(json_data, "\"title\"") || !strstr(json_data, "\"byline\""))
+		return NULL;
 
 	root_value = json_parse_string(json_data);
 	if (json_value_get_type(root_value) != JSONObject) {
@@ -391,316 +501,400 @@ notification_info_t *get_json_notification(gchar *json_data, gboolean free_unpar
 
 	root = json_value_get_object(root_value);
 
-	title = json_object_get_string(root, "title");
-	if (!title) {
-		json_value_free(root_value);
-		return NULL;
+	/* Pick out the values of the known keys in a single pass. */
+	count = json_object_get_count(root);
+	for (i = 0; i < count; i++) {
+		name = json_object_get_name(root, i);
+		field = lookup_json_field(name);
+		if (field >= 0)
+			values[field] = json_object_get_value_at(root, i);
 	}
 
-	byline = json_object_get_string(root, "byline");
-	if (!byline) {
+	if (!json_value_get_string(values[JSON_FIELD_TITLE]) ||
+	    !json_value_get_string(values[JSON_FIELD_BYLINE])) {
 		json_value_free(root_value);
 		return NULL;
 	}
 
-	image_path = json_object_get_string(root, "image");
-	command = json_object_get_string(root, "command");
-	sound = json_object_get_string(root, "sound");
-	type = json_object_get_string(root, "type");
-	button1_label = json_object_get_string(root, "button1_label");
-	button1_colour = json_object_get_string(root, "button1_colour");
-	button1_hover = json_object_get_string(root, "button1_hover");
-	button1_command = json_object_get_string(root, "button1_command");
-	button2_label = json_object_get_string(root, "button2_label");
-	button2_colour = json_object_get_string(root, "button2_colour");
-	button2_command = json_object_get_string(root, "button2_command");
-	button2_hover = json_object_get_string(root, "button2_hover");
-
-	notification_info_t *data = g_new0(notification_info_t, 1);
-
-	data->unparsed = json_data;
-	data->free_unparsed = free_unparsed;
-
-	data->title = g_new0(gchar, strlen(title) + 1);
-	g_strlcpy(data->title, title, strlen(title) + 1);
-
-	data->byline = g_new0(gchar, strlen(byline) + 1);
-	g_strlcpy(data->byline, byline, strlen(byline) + 1);
-
-	if (image_path) {
-		data->image_path = g_new0(gchar, strlen(image_path) + 1);
-		g_strlcpy(data->image_path, image_path, strlen(image_path) + 1);
-	}
-
-	if (command) {
-		data->command = g_new0(gchar, strlen(command) + 1);
-		g_strlcpy(data->command, command, strlen(command) + 1);
-	}
+	draft.unparsed = (gchar *)json_data;
+	draft.urgency = URGENCY_NORMAL;
 
-	if (sound) {
-		data->sound = g_new0(gchar, strlen(sound) + 1);
-		g_strlcpy(data->sound, sound, strlen(sound) + 1);
-	}
-
-	if (type) {
-		data->type = g_new0(gchar, strlen(type) + 1);
-		g_strlcpy(data->type, type, strlen(type) + 1);
-	}
+	for (field = 0; field < N_JSON_FIELDS; field++) {
+		const struct json_field *def = &(json_fields[field]);
 
-	if (button1_label) {
-		data->button1_label = g_new0(gchar, strlen(button1_label) + 1);
-		g_strlcpy(data->button1_label, button1_label,
-			  strlen(button1_label) + 1);
+		/* The button details are only used with a label. */
+		if (def->needs != JSON_FIELD_NONE &&
+		    !json_value_get_string(values[def->needs]))
+			continue;
 
-		if (button1_colour) {
-			data->button1_colour = g_new0(gchar, strlen(button1_colour) + 1);
-			g_strlcpy(data->button1_colour, button1_colour,
-				  strlen(button1_colour) + 1);
+		if (def->number == 0) {
+			G_STRUCT_MEMBER(const gchar *, &draft, def->offset) =
+				json_value_get_string(values[field]);
+			continue;
 		}
 
-		if (button1_hover) {
-			data->button1_hover = g_new0(gchar, strlen(button1_hover) + 1);
-			g_strlcpy(data->button1_hover, button1_hover,
-				  strlen(button1_hover) + 1);
-		}
+		/* Anything else, null included, keeps the default. */
+		if (json_value_get_type(values[field]) != JSONNumber)
+			continue;
 
-		if (button1_command) {
-			data->button1_command = g_new0(gchar, strlen(button1_command) + 1);
-			g_strlcpy(data->button1_command, button1_command,
-				  strlen(button1_command) + 1);
-		}
+		number = CLAMP(json_value_get_number(values[field]),
+			       def->min, def->max);
+		if (def->number == sizeof(gint64))
+			G_STRUCT_MEMBER(gint64, &draft, def->offset) = number;
+		else
+			G_STRUCT_MEMBER(gint, &draft, def->offset) = number;
 	}
 
-	if (button2_label) {
-		data->button2_label = g_new0(gchar, strlen(button2_label) + 1);
-		g_strlcpy(data->button2_label, button2_label,
-			  strlen(button2_label) + 1);
-
-		if (button2_colour) {
-			data->button2_colour = g_new0(gchar, strlen(button2_colour) + 1);
-			g_strlcpy(data->button2_colour, button2_colour,
-				  strlen(button2_colour) + 1);
-		}
+	/* An explicit expires_at wins, the ttl is only kept if it's what
+	   the expiry was worked out from. */
+	if (draft.expires_at != 0)
+		draft.ttl = 0;
+	else if (draft.ttl > 0)
+		draft.expires_at = g_get_real_time() / G_USEC_PER_SEC + draft.ttl;
 
-		if (button2_hover) {
-			data->button2_hover = g_new0(gchar, strlen(button2_hover) + 1);
-			g_strlcpy(data->button2_hover, button2_hover,
-				  strlen(button2_hover) + 1);
-		}
-
-		if (button2_command) {
-			data->button2_command = g_new0(gchar, strlen(button2_command) + 1);
-			g_strlcpy(data->button2_command, button2_command,
-				  strlen(button2_command) + 1);
-		}
-	}
+	if (!draft.category)
+		draft.category = draft.type;
 
+	/* The values live in the parsed tree, so pack them before it goes. */
+	data = pack_notification(&draft);
 	json_value_free(root_value);
 
 	return data;
 }
 
-/* Returns TRUE if the two notifications are similar in terms of their content
+/*
+ * Tell what kind of message this is without parsing it.
  *
- * NOTE: This fn is certainly not an exhaustive comparison of the notification
- * structures. It mainly focuses on the most visually important attributes.
- * It is also optimised to exit quickly as soon as a difference is observed.
+ * The commands start with CONTROL_PREFIX or are single lowercase words,
+ * every id has a colon in it and only JSON objects start with a brace.
+ * So the message is scanned once, usually only up to the first few
+ * characters, and none of the parsers is tried on something it can't
+ * handle.
  */
-static gboolean notifcmp(notification_info_t *this, notification_info_t *other)
+message_class_t classify_message(const gchar *msg)
 {
-	if (this == NULL || other == NULL)
-		return FALSE;
+	const gchar *p = msg;
 
-	if (this == other)
-		return TRUE;
+	if (*p == CONTROL_PREFIX)
+		return MESSAGE_CONTROL;
 
-	if (g_strcmp0(this->title, other->title) != 0)
-		return FALSE;
+	/* All the bare commands are made of these. */
+	while (g_ascii_islower(*p) || *p == '_')
+		p++;
 
-	if (g_strcmp0(this->byline, other->byline) != 0)
-		return FALSE;
+	if (*p == '\0')
+		return is_legacy_command(msg, p - msg) ?
+			MESSAGE_CONTROL : MESSAGE_UNKNOWN;
 
-	if (g_strcmp0(this->type, other->type) != 0)
-		return FALSE;
+	if (*p == ':')
+		return MESSAGE_ID;
 
-	if (g_strcmp0(this->command, other->command) != 0)
-		return FALSE;
+	/* JSON can have some whitespace in front of it. */
+	if (p == msg) {
+		while (g_ascii_isspace(*p))
+			p++;
 
-	if (g_strcmp0(this->image_path, other->image_path) != 0)
-		return FALSE;
-
-	if (g_strcmp0(this->sound, other->sound) != 0)
-		return FALSE;
+		if (*p == '{')
+			return MESSAGE_JSON;
+	}
 
-	return TRUE;
+	return strchr(p, ':') ? MESSAGE_ID : MESSAGE_UNKNOWN;
 }
 
-/* Returns whether the last element of the list is the registration reminder,
+/*
+ * Parse a message that's already been classified with the parser that
+ * can handle it.
  */
-static gboolean is_last_element_reminder(kano_notifications_t *plugin_data)
+static notification_info_t *parse_notification_as(gchar *msg,
+						  message_class_t class)
 {
-	GList *last = NULL;
-	notification_info_t *notif_last = NULL;
-	notification_info_t *notif_reminder = NULL;
-
-	if (plugin_data == NULL)
-		return FALSE;
-
-	last = g_list_last(plugin_data->queue);
-	if (last == NULL)
-		return FALSE;
-	notif_last = last->data;
+	switch (class) {
+	case MESSAGE_JSON:
+		return get_json_notification(msg);
+	case MESSAGE_ID:
+		return get_notification_by_id(msg);
+	default:
+		return NULL;
+	}
+}
 
-	notif_reminder = get_json_notification(REGISTER_REMINDER, FALSE);
+/*
+ * Turn a message into a notification, it can be either a JSON or an id.
+ *
+ * The message isn't referenced by the notification, so it can be freed
+ * or reused straight away. Returns NULL if the message isn't valid.
+ */
+notification_info_t *parse_notification(gchar *msg)
+{
+	return parse_notification_as(msg, classify_message(msg));
+}
 
-	return notifcmp(notif_last, notif_reminder);
+/*
+ * The journal and the spill file keep the message along with the time
+ * its notification expires, e.g. "@1570000000 level:5", so reading it
+ * back doesn't start its ttl over again.
+ *
+ * WARNING: You're expected to g_free() the string returned.
+ */
+gchar *save_message(const notification_info_t *data)
+{
+	return g_strdup_printf("@%" G_GINT64_FORMAT " %s", data->expires_at,
+			       data->unparsed);
 }
 
-static void append_reminder_to_q(kano_notifications_t *plugin_data)
+/*
+ * Same as parse_notification(), but for a message from save_message().
+ * A message saved without the expiry time is parsed as it is.
+ */
+notification_info_t *parse_saved_message(gchar *msg)
 {
-	notification_info_t *notif = NULL;
+	notification_info_t *data;
+	gint64 expires_at;
+	gchar *end;
 
-	if (plugin_data == NULL) {
-		return;
-	}
+	if (msg[0] != '@')
+		return parse_notification(msg);
 
-	if (!is_internet())
-		return;
+	expires_at = g_ascii_strtoll(msg + 1, &end, 10);
+	if (end == msg + 1 || *end != ' ')
+		return NULL;
 
-	if (!is_user_registered()) {
-		notif = get_json_notification(REGISTER_REMINDER, FALSE);
-		plugin_data->queue = g_list_append(plugin_data->queue, notif);
-	}
+	/* The default ttl was applied when it was first queued. */
+	data = parse_notification(end + 1);
+	if (data)
+		data->expires_at = expires_at > 0 ? expires_at : EXPIRES_NEVER;
+
+	return data;
 }
 
 /*
- * The main loop of this widget. It sets up an IO watch for the pipe and
- * waits for incomming data. It will trigger different actions based on
- * the data received.
- *
- * WARNING: I've seen some deadlocks when doing too much within the
- *          handler itself. If the action takes a long time, it's better
- *          to schedule it for the GTK main loop to execute outside of
- *          this code path.
+ * The outcome of a message, as it's sent back to the producer.
  */
-static gboolean io_watch_cb(GIOChannel *source, GIOCondition cond, gpointer data)
-{
-	kano_notifications_t *plugin_data = (kano_notifications_t *)data;
-
-	gchar *line = NULL;
-	gsize len, tpos;
-	GIOStatus status;
-
-	status = g_io_channel_read_line(source, &line, &len, &tpos, NULL);
-	if (status == G_IO_STATUS_NORMAL) {
-		/* Removes the newline character at the and of the line */
-		line[tpos] = '\0';
-
-		/* This has to come before the enabled check. */
-		if (g_strcmp0(line, "enable") == 0) {
-			g_mutex_lock(&(plugin_data->lock));
-			plugin_data->conf.enabled = TRUE;
-			g_mutex_unlock(&(plugin_data->lock));
-			save_conf(&(plugin_data->conf));
-			g_free(line);
-			return TRUE;
-		}
+typedef struct {
+	ingest_status_t status;
+	gchar *text;	/* replaces the status and is sent even without ack */
+} reply_t;
 
-		if (!plugin_data->conf.enabled) {
-			g_free(line);
-			return TRUE;
-		}
+static guint add_reply(GArray *replies, ingest_status_t status, gchar *text)
+{
+	reply_t reply = { status, text };
 
-		if (g_strcmp0(line, "disable") == 0) {
-			g_mutex_lock(&(plugin_data->lock));
-			plugin_data->conf.enabled = FALSE;
-			g_mutex_unlock(&(plugin_data->lock));
-			save_conf(&(plugin_data->conf));
-			g_free(line);
-			return TRUE;
-		}
+	g_array_append_val(replies, reply);
+	return replies->len - 1;
+}
 
-		if (g_strcmp0(line, "allow_world_notifications") == 0) {
-			g_mutex_lock(&(plugin_data->lock));
-			plugin_data->conf.allow_world_notifications = TRUE;
-			g_mutex_unlock(&(plugin_data->lock));
-			save_conf(&(plugin_data->conf));
-			g_free(line);
-			return TRUE;
+/*
+ * Send the outcome of the messages back to the producer, one per line.
+ * In ack mode that's every message, otherwise only the replies to the
+ * control commands.
+ *
+ * The replies are best effort. They are dropped rather than blocking the
+ * daemon if the producer doesn't read them.
+ */
+static void send_replies(ingest_source_t *src, GArray *replies)
+{
+	static const gchar *statuses[] = {
+		[INGEST_OK] = "ok",
+		[INGEST_IGNORED] = "ignored",
+		[INGEST_QUEUE_FULL] = "queue-full",
+		[INGEST_INVALID] = "invalid",
+	};
+	GString *msg = g_string_sized_new(replies->len * 8);
+	reply_t *reply;
+	guint i;
+
+	for (i = 0; i < replies->len; i++) {
+		reply = &g_array_index(replies, reply_t, i);
+
+		if (reply->text) {
+			g_string_append(msg, reply->text);
+			g_string_append_c(msg, '\n');
+			g_free(reply->text);
+		} else if (src->ack) {
+			g_string_append(msg, statuses[reply->status]);
+			g_string_append_c(msg, '\n');
 		}
+	}
 
-		if (g_strcmp0(line, "disallow_world_notifications") == 0) {
-			g_mutex_lock(&(plugin_data->lock));
-			plugin_data->conf.allow_world_notifications = FALSE;
-			g_mutex_unlock(&(plugin_data->lock));
-			save_conf(&(plugin_data->conf));
-			g_free(line);
-			return TRUE;
-		}
+	if (src->reply_fd >= 0 && msg->len > 0 &&
+	    send(src->reply_fd, msg->str, msg->len,
+		 MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && errno != EAGAIN)
+		perror("send");
 
-		if (g_strcmp0(line, "pause") == 0) {
-			g_mutex_lock(&(plugin_data->lock));
-			plugin_data->paused = TRUE;
-			g_mutex_unlock(&(plugin_data->lock));
-			g_free(line);
-			return TRUE;
-		}
+	g_string_free(msg, TRUE);
+}
 
-		if (g_strcmp0(line, "resume") == 0) {
-			g_mutex_lock(&(plugin_data->lock));
-			plugin_data->paused = FALSE;
+/*
+ * Log how much work the last wakeup of a source watch did, once every
+ * INGEST_STATS_INTERVAL wakeups. The totals are always available through
+ * the !stats command.
+ */
+static void report_ingest_stats(kano_notifications_t *plugin_data)
+{
+	struct ingest_stats *stats = &(plugin_data->stats);
 
-			g_idle_add((GSourceFunc) show_notification_window_from_q, plugin_data);
+	if (stats->wakeups % INGEST_STATS_INTERVAL != 0)
+		return;
 
-			g_mutex_unlock(&(plugin_data->lock));
-			g_free(line);
-			return TRUE;
-		}
+	g_debug("ingest: %u lines in %" G_GINT64_FORMAT " us "
+		"(%.1f lines/wakeup, %" G_GINT64_FORMAT " us total, max batch %u, "
+		"%" G_GUINT64_FORMAT " oversize)",
+		stats->last_batch, stats->last_ingest_us,
+		(gdouble) stats->lines / stats->wakeups,
+		stats->total_ingest_us, stats->max_batch, stats->oversize);
+	g_debug("ingest: %" G_GUINT64_FORMAT " control, %" G_GUINT64_FORMAT
+		" json, %" G_GUINT64_FORMAT " id, %" G_GUINT64_FORMAT " unknown",
+		stats->classes[MESSAGE_CONTROL], stats->classes[MESSAGE_JSON],
+		stats->classes[MESSAGE_ID], stats->classes[MESSAGE_UNKNOWN]);
+}
 
-		/* See if the notification is a JSON */
-		notification_info_t *data = get_json_notification(line, TRUE);
+/*
+ * A notification waiting to be queued along with the position of its
+ * reply.
+ */
+typedef struct {
+	notification_info_t *notification;
+	guint index;
+} pending_notification_t;
 
-		if (!data)
-			data = get_notification_by_id(line, TRUE);
+/*
+ * Hand over a batch of parsed notifications, fill in their outcome and
+ * send the replies. Both arrays are emptied for the next batch.
+ */
+static void flush_batch(kano_notifications_t *plugin_data,
+			ingest_source_t *src, GArray *batch, GArray *replies)
+{
+	pending_notification_t pending;
+	ingest_status_t status;
+	gboolean handed_off = FALSE;
+	guint i;
+
+	for (i = 0; i < batch->len; i++) {
+		pending = g_array_index(batch, pending_notification_t, i);
+		status = hand_off_notification(plugin_data, pending.notification);
+		g_array_index(replies, reply_t, pending.index).status = status;
+
+		if (status == INGEST_OK)
+			handed_off = TRUE;
+	}
 
-		/* if data is valid, we pass ownership of 'line' to it for later use.
-		   It is then freed when 'data' is freed */
-		if(!data)
-			g_free(line);
+	if (handed_off)
+		wake_up_ui(plugin_data);
 
+	send_replies(src, replies);
 
-		if (data) {
-			g_mutex_lock(&(plugin_data->lock));
+	g_array_set_size(batch, 0);
+	g_array_set_size(replies, 0);
+}
 
-			/* Don't queue world notifications in case they are
-			   being filtered. This also ignores any incomming
-			   notifications beyond the maximum limit set. */
-			if ((IS_TYPE(data, "world") &&
-			    !plugin_data->conf.allow_world_notifications) ||
-			    g_list_length(plugin_data->queue) >=
-			    MAX_QUEUE_LEN) {
-				g_mutex_unlock(&(plugin_data->lock));
-				return TRUE;
+/*
+ * Drain the complete messages that are waiting on the source.
+ *
+ * The lines are framed in place within the source's buffer, so nothing
+ * gets allocated for messages that aren't kept. Control commands are
+ * applied as they are read, the notifications are parsed and handed over
+ * to the GTK main loop to be queued. The replies to the control commands
+ * and, if the producer asked for it, the outcome of every message are
+ * sent back after each read.
+ *
+ * Reading stops once INGEST_MAX_LINES_PER_WAKEUP lines have been taken so
+ * that a busy producer can't hold up the other sources. The rest stays in
+ * the pipe and the watch fires again for it.
+ *
+ * Returns the result of the last read, see msgbuf_fill().
+ */
+gssize ingest_source(kano_notifications_t *plugin_data, ingest_source_t *src)
+{
+	struct ingest_stats *stats = &(plugin_data->stats);
+	GArray *batch = g_array_new(FALSE, FALSE, sizeof(pending_notification_t));
+	GArray *replies = g_array_new(FALSE, FALSE, sizeof(reply_t));
+	ingest_status_t status;
+	msgbuf_result_t framing;
+	message_class_t class;
+	pending_notification_t pending;
+	gchar *line = NULL, *text;
+	gssize count = 0;
+	guint lines = 0;
+	gint64 start = g_get_monotonic_time();
+
+	while (lines < INGEST_MAX_LINES_PER_WAKEUP &&
+	       (count = msgbuf_fill(&(src->buf), src->fd)) > 0) {
+		while ((framing = msgbuf_next(&(src->buf), &line, NULL)) !=
+		       MSGBUF_NEED_MORE) {
+			lines++;
+
+			if (framing == MSGBUF_OVERSIZE)
+				stats->oversize++;
+
+			if (framing != MSGBUF_MESSAGE) {
+				add_reply(replies, INGEST_INVALID, NULL);
+				continue;
 			}
 
-			if (is_last_element_reminder(plugin_data) == TRUE && (g_list_length(plugin_data->queue) > 1)) {
-				GList *last = NULL;
+			class = classify_message(line);
+			stats->classes[class]++;
 
-				last = g_list_last(plugin_data->queue);
-				plugin_data->queue = g_list_insert_before(plugin_data->queue, last, data);
-			} else {
-				plugin_data->queue = g_list_append(plugin_data->queue, data);
-				append_reminder_to_q(plugin_data);
+			if (class == MESSAGE_CONTROL) {
+				status = handle_control(plugin_data, src, line,
+							&text);
+				add_reply(replies, status, text);
+				continue;
+			}
 
+			/* Everything is swallowed while the notifications
+			   are disabled. */
+			if (!plugin_data->conf.enabled) {
+				add_reply(replies, INGEST_IGNORED, NULL);
+				continue;
 			}
-			if (g_list_length(plugin_data->queue) <= 2 &&
-				!plugin_data->paused) {
-				g_idle_add((GSourceFunc) show_notification_window_from_q, plugin_data);
+
+			notification_info_t *notif = parse_notification_as(line,
+									   class);
+			if (!notif) {
+				add_reply(replies, INGEST_INVALID, NULL);
+				continue;
 			}
 
-			g_mutex_unlock(&(plugin_data->lock));
+			/* The real status is filled in when it's handed over. */
+			pending.notification = notif;
+			pending.index = add_reply(replies, INGEST_OK, NULL);
+			g_array_append_val(batch, pending);
 		}
+
+		flush_batch(plugin_data, src, batch, replies);
 	}
 
+	if (lines > 0) {
+		stats->wakeups++;
+		stats->lines += lines;
+		stats->last_batch = lines;
+		stats->max_batch = MAX(stats->max_batch, lines);
+		stats->last_ingest_us = g_get_monotonic_time() - start;
+		stats->total_ingest_us += stats->last_ingest_us;
+		report_ingest_stats(plugin_data);
+	}
+
+	g_array_free(batch, TRUE);
+	g_array_free(replies, TRUE);
+
+	return count;
+}
+
+/*
+ * The main loop of this widget. It sets up an IO watch for the pipe and
+ * waits for incomming data. It will trigger different actions based on
+ * the data received.
+ *
+ * WARNING: I've seen some deadlocks when doing too much within the
+ *          handler itself. If the action takes a long time, it's better
+ *          to schedule it for the GTK main loop to execute outside of
+ *          this code path.
+ */
+static gboolean io_watch_cb(GIOChannel *source, GIOCondition cond, gpointer data)
+{
+	kano_notifications_t *plugin_data = (kano_notifications_t *)data;
+
+	ingest_source(plugin_data, &(plugin_data->fifo));
+
 	return TRUE;
 }
@@ -0,0 +1,296 @@
+/*
+ * msgbuf.c
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ */
+
+#include <glib.h>
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "msgbuf.h"
+
+
+void msgbuf_init(msgbuf_t *buf, gsize max_message)
+{
+	buf->data = g_new0(gchar, MSGBUF_INITIAL_SIZE);
+	buf->size = MSGBUF_INITIAL_SIZE;
+	buf->start = 0;
+	buf->end = 0;
+	buf->scanned = 0;
+	buf->max_message = max_message;
+	buf->skip = 0;
+	buf->discarding = FALSE;
+	buf->oversize = 0;
+	buf->restore_at = -1;
+}
+
+void msgbuf_clear(msgbuf_t *buf)
+{
+	g_free(buf->data);
+	buf->data = NULL;
+	buf->size = 0;
+	buf->start = 0;
+	buf->end = 0;
+	buf->scanned = 0;
+	buf->skip = 0;
+	buf->discarding = FALSE;
+	buf->restore_at = -1;
+}
+
+/*
+ * Put back the first byte of the next message which was replaced by the
+ * terminator of the previous binary frame.
+ */
+static void msgbuf_restore(msgbuf_t *buf)
+{
+	if (buf->restore_at >= 0) {
+		buf->data[buf->restore_at] = buf->restore_byte;
+		buf->restore_at = -1;
+	}
+}
+
+/*
+ * Make sure there's at least MSGBUF_READ_CHUNK bytes of free space at
+ * the end of the buffer. The partial message that's left over from the
+ * previous read is moved to the front first, the buffer only grows when
+ * a single message doesn't fit. Anything longer than max_message has been
+ * dropped by msgbuf_next() by now, which bounds the growth.
+ *
+ * A buffer that grew for a long message goes back to the initial size
+ * once it's empty again, so idle sources don't hold on to the memory.
+ */
+static void msgbuf_reserve(msgbuf_t *buf)
+{
+	gsize pending = buf->end - buf->start;
+
+	if (pending == 0 && buf->size > MSGBUF_INITIAL_SIZE) {
+		buf->data = g_renew(gchar, buf->data, MSGBUF_INITIAL_SIZE);
+		buf->size = MSGBUF_INITIAL_SIZE;
+	}
+
+	if (buf->start > 0) {
+		if (pending > 0)
+			memmove(buf->data, buf->data + buf->start, pending);
+
+		buf->scanned -= buf->start;
+		buf->start = 0;
+		buf->end = pending;
+	}
+
+	if (buf->size - buf->end < MSGBUF_READ_CHUNK) {
+		while (buf->size - buf->end < MSGBUF_READ_CHUNK)
+			buf->size *= 2;
+		buf->data = g_renew(gchar, buf->data, buf->size);
+	}
+}
+
+/*
+ * Read whatever is available from fd into the buffer.
+ *
+ * Returns the number of bytes read, 0 at the end of the stream, or -1
+ * with errno set. EAGAIN means the descriptor has been drained.
+ *
+ * WARNING: This invalidates the messages returned by msgbuf_next().
+ */
+gssize msgbuf_fill(msgbuf_t *buf, int fd)
+{
+	gssize count;
+
+	msgbuf_restore(buf);
+	msgbuf_reserve(buf);
+
+	/* One byte is always kept spare for terminating a frame that
+	   ends at the very end of the data. */
+	do {
+		count = read(fd, buf->data + buf->end,
+			     buf->size - buf->end - 1);
+	} while (count < 0 && errno == EINTR);
+
+	if (count > 0)
+		buf->end += count;
+
+	return count;
+}
+
+/*
+ * Drop the rest of a rejected frame as it arrives.
+ */
+static void msgbuf_skip(msgbuf_t *buf)
+{
+	gsize count = MIN(buf->skip, buf->end - buf->start);
+
+	buf->start += count;
+	buf->scanned = buf->start;
+	buf->skip -= count;
+}
+
+/*
+ * Decode the header of the binary frame at the start of the buffer and
+ * return its payload if it has arrived in full.
+ *
+ * A frame that is too large or contains a NUL byte is rejected. Its
+ * length is known, so exactly that many bytes are dropped and the next
+ * message is read from where the frame ended. A large frame is dropped
+ * as it arrives, without being buffered.
+ */
+static msgbuf_result_t msgbuf_next_frame(msgbuf_t *buf, gchar **msg, gsize *len)
+{
+	guchar *header = (guchar *)buf->data + buf->start;
+	guchar *end = (guchar *)buf->data + buf->end;
+	guchar *p = header + 1;
+	guint64 size = 0;
+	guint shift = 0;
+	gchar *payload;
+
+	for (;;) {
+		if (p >= end)
+			return MSGBUF_NEED_MORE;
+
+		size |= (guint64)(*p & 0x7f) << shift;
+		shift += 7;
+
+		if (!(*p++ & 0x80))
+			break;
+
+		/* There's no telling where this frame ends. Drop the
+		   header and carry on with whatever follows. */
+		if (p - header > MSGBUF_MAX_VARINT_LEN) {
+			buf->start += p - header;
+			buf->scanned = buf->start;
+			return MSGBUF_BAD_FRAME;
+		}
+	}
+
+	if (size > buf->max_message) {
+		buf->start += p - header;
+		buf->skip = size;
+		buf->oversize++;
+		msgbuf_skip(buf);
+		return MSGBUF_OVERSIZE;
+	}
+
+	if ((gsize)(end - p) < size)
+		return MSGBUF_NEED_MORE;
+
+	payload = (gchar *)p;
+	buf->start = payload + size - buf->data;
+	buf->scanned = buf->start;
+
+	if (memchr(payload, '\0', size))
+		return MSGBUF_BAD_FRAME;
+
+	/* Terminate the payload in place, the byte that belongs to the
+	   next message is put back before it's needed. */
+	buf->restore_at = buf->start;
+	buf->restore_byte = buf->data[buf->start];
+	buf->data[buf->start] = '\0';
+
+	*msg = payload;
+	if (len)
+		*len = size;
+
+	return MSGBUF_MESSAGE;
+}
+
+/*
+ * Get the next complete message from the buffer.
+ *
+ * The message is terminated with a '\0' in place, so it points directly
+ * into the buffer. It stays valid until the next call to msgbuf_next()
+ * or msgbuf_fill(). Copy whatever needs to be kept for longer.
+ *
+ * MSGBUF_OVERSIZE is returned once for each message over the limit.
+ */
+msgbuf_result_t msgbuf_next(msgbuf_t *buf, gchar **msg, gsize *len)
+{
+	gchar *line, *newline;
+
+	msgbuf_restore(buf);
+
+	if (buf->skip > 0) {
+		msgbuf_skip(buf);
+		if (buf->skip > 0)
+			return MSGBUF_NEED_MORE;
+	}
+
+	/* Drop the rest of a long line up to and including its newline. */
+	if (buf->discarding) {
+		newline = memchr(buf->data + buf->start, '\n',
+				 buf->end - buf->start);
+		buf->start = newline ? newline - buf->data + 1 : buf->end;
+		buf->scanned = buf->start;
+		if (!newline)
+			return MSGBUF_NEED_MORE;
+
+		buf->discarding = FALSE;
+	}
+
+	if (buf->start == buf->end)
+		return MSGBUF_NEED_MORE;
+
+	if ((guchar)buf->data[buf->start] == MSGBUF_FRAME_MAGIC)
+		return msgbuf_next_frame(buf, msg, len);
+
+	line = buf->data + buf->start;
+	newline = memchr(buf->data + buf->scanned, '\n',
+			 buf->end - buf->scanned);
+	if (!newline) {
+		buf->scanned = buf->end;
+
+		/* It's too long already, don't wait for the rest of it. */
+		if (buf->end - buf->start > buf->max_message) {
+			buf->start = buf->end;
+			buf->scanned = buf->end;
+			buf->discarding = TRUE;
+			buf->oversize++;
+			return MSGBUF_OVERSIZE;
+		}
+
+		return MSGBUF_NEED_MORE;
+	}
+
+	if ((gsize)(newline - line) > buf->max_message) {
+		buf->start = newline - buf->data + 1;
+		buf->scanned = buf->start;
+		buf->oversize++;
+		return MSGBUF_OVERSIZE;
+	}
+
+	*newline = '\0';
+	*msg = line;
+	if (len)
+		*len = newline - line;
+
+	buf->start = newline - buf->data + 1;
+	buf->scanned = buf->start;
+
+	return MSGBUF_MESSAGE;
+}
+
+/*
+ * Write the header of a binary frame with a payload of len bytes.
+ * The header buffer needs to be at least MSGBUF_MAX_HEADER_LEN long.
+ *
+ * Returns the length of the header.
+ */
+gsize msgbuf_frame_header(guchar *header, gsize len)
+{
+	gsize pos = 0;
+
+	header[pos++] = MSGBUF_FRAME_MAGIC;
+
+	do {
+		header[pos] = len & 0x7f;
+		len >>= 7;
+		if (len)
+			header[pos] |= 0x80;
+		pos++;
+	} while (len && pos < MSGBUF_MAX_HEADER_LEN);
+
+	return pos;
+}
@@ -0,0 +1,69 @@
+/*
+ * msgbuf.h
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * A reusable input buffer that reads from a file descriptor and splits
+ * the data into messages in place.
+ *
+ * Messages are normally terminated by a newline. A message can also be
+ * sent as a binary frame which starts with MSGBUF_FRAME_MAGIC followed
+ * by the length of the payload encoded as an unsigned LEB128 varint and
+ * the payload itself. The payload isn't scanned, so it may contain raw
+ * newlines. Both kinds can be mixed freely on the same stream.
+ *
+ * Messages longer than the limit given to msgbuf_init() are dropped as
+ * they arrive, so the buffer never holds more than one message of that
+ * size plus a read chunk, whatever the producer writes.
+ *
+ */
+
+#include <glib.h>
+
+#ifndef notif_msgbuf_h
+#define notif_msgbuf_h
+
+#define MSGBUF_INITIAL_SIZE 4096
+#define MSGBUF_READ_CHUNK 4096
+
+/* Never valid in UTF-8 text, so it can't start a line by accident. */
+#define MSGBUF_FRAME_MAGIC 0xfe
+
+/* A varint with more bytes than this is treated as a corrupted header. */
+#define MSGBUF_MAX_VARINT_LEN 5
+#define MSGBUF_MAX_HEADER_LEN (1 + MSGBUF_MAX_VARINT_LEN)
+
+typedef enum {
+	MSGBUF_NEED_MORE,	/* no complete message in the buffer */
+	MSGBUF_MESSAGE,		/* a message was returned */
+	MSGBUF_BAD_FRAME,	/* a binary frame was rejected */
+	MSGBUF_OVERSIZE,	/* a message over the limit is being dropped */
+} msgbuf_result_t;
+
+typedef struct {
+	gchar *data;
+	gsize size;	/* allocated size of data */
+	gsize start;	/* first byte that wasn't consumed yet */
+	gsize end;	/* one past the last byte read */
+	gsize scanned;	/* no newline between start and this offset */
+
+	gsize max_message; /* longest message that is kept */
+	gsize skip;	/* bytes of a rejected frame still to be dropped */
+	gboolean discarding; /* dropping a long line up to its newline */
+	guint64 oversize; /* messages dropped for being too long */
+
+	/* The byte overwritten by the terminator of the last frame. */
+	gssize restore_at;
+	gchar restore_byte;
+} msgbuf_t;
+
+void msgbuf_init(msgbuf_t *buf, gsize max_message);
+void msgbuf_clear(msgbuf_t *buf);
+
+gssize msgbuf_fill(msgbuf_t *buf, int fd);
+msgbuf_result_t msgbuf_next(msgbuf_t *buf, gchar **msg, gsize *len);
+
+gsize msgbuf_frame_header(guchar *header, gsize len);
+
+#endif
@@ -9,15 +9,52 @@
  */
 
 
-#include <gtk/gtk.h>
-
 #ifndef notif_notifications_h
 #define notif_notifications_h
 
+#include <gtk/gtk.h>
+
+#include "msgbuf.h"
+#include "spsc.h"
+#include "deque.h"
+#include "journal.h"
+
+
+#define DEFAULT_MAX_QUEUE_LEN 50
+#define DEFAULT_OVERFLOW_POLICY OVERFLOW_DROP_NEWEST
+#define DEFAULT_JOURNAL_SYNC_INTERVAL 5
+#define DEFAULT_MAX_MESSAGE_SIZE (64 * 1024)
+#define DEFAULT_COALESCE_CATEGORIES "level"	/* comma separated */
+#define DEFAULT_TTL (30 * 60)
+#define DEFAULT_STACK_SIZE 1
+#define MAX_STACK_SIZE 4
+#define DEFAULT_DIGEST_THRESHOLD 20
+
+// The following are in seconds. The timer is not guaranteed to be super precise
+#define DEFAULT_ON_TIME 60
+#define DEFAULT_MIN_ON_TIME 10
+
+/* An expires_at past any real time, for saved notifications that were
+   let off the default ttl. */
+#define EXPIRES_NEVER G_MAXUINT32
+
+/* Room for the "@<expires_at> " in front of a saved message. */
+#define SAVED_MESSAGE_PREFIX_LEN 24
 
 #define IS_TYPE(notification, notif_type) \
 	(notification->type && g_strcmp0(notification->type, notif_type) == 0)
 
+/*
+ * What happens to a notification that arrives when the queue is full.
+ */
+typedef enum {
+	OVERFLOW_DROP_NEWEST,		/* the new one is dropped */
+	OVERFLOW_DROP_OLDEST,		/* the oldest waiting one is dropped */
+	OVERFLOW_COALESCE_BY_TYPE,	/* replaces a waiting one of the same type */
+	OVERFLOW_SPILL_TO_DISK,		/* kept on disk until there's room */
+	N_OVERFLOW_POLICIES
+} overflow_policy_t;
+
 /*
  * The structure used by the load_conf() and save_conf() functions to
  * hold the configuration of the widget.
@@ -25,44 +62,250 @@
 struct notification_conf {
 	gboolean enabled;
 	gboolean allow_world_notifications;
+
+	guint max_queue_len;
+	overflow_policy_t overflow_policy;
+
+	guint journal_sync_interval; /* in seconds, 0 only syncs on exit */
+
+	guint max_message_size; /* in bytes, longer messages are dropped */
+
+	/* How long a notification is shown, in seconds. It's the longest
+	   time, the more are waiting the shorter it gets. */
+	guint on_time;
+	guint min_on_time;
+
+	guint stack_size; /* how many notifications are shown at once */
+
+	guint default_ttl; /* in seconds, for notifications without one,
+			      0 keeps them until they're shown */
+
+	guint digest_threshold; /* more waiting than this are summed up in
+				   a digest, 0 never does */
+
+	/* A newer notification of these categories replaces a queued one,
+	   NULL terminated. */
+	gchar **coalesce_categories;
 };
 
+/*
+ * The outcome of a single message sent to the daemon.
+ */
+typedef enum {
+	INGEST_OK,		/* command applied or notification queued */
+	INGEST_IGNORED,		/* disabled, filtered out or a duplicate */
+	INGEST_QUEUE_FULL,	/* no room left in the queue */
+	INGEST_INVALID,		/* not a command or a notification */
+} ingest_status_t;
+
+/*
+ * What kind of message a line is, as far as can be told from its first
+ * few bytes.
+ */
+typedef enum {
+	MESSAGE_CONTROL,	/* one of the control commands */
+	MESSAGE_JSON,		/* a JSON object */
+	MESSAGE_ID,		/* a colon separated id, e.g. level:5 */
+	MESSAGE_UNKNOWN,	/* can't be any of the above */
+	N_MESSAGE_CLASSES
+} message_class_t;
+
+/*
+ * How urgent a notification is. There's a queue for each level, the
+ * values are the ones sent by the notifications.py module.
+ */
+typedef enum {
+	URGENCY_LOW,
+	URGENCY_NORMAL,		/* the default */
+	URGENCY_CRITICAL,	/* can take the place of the one being shown */
+	N_URGENCIES
+} urgency_t;
+
+/*
+ * Notifications the daemon queues on its own are told apart from the
+ * ones it received by their kind.
+ */
+typedef enum {
+	NOTIFICATION_REGULAR,	/* parsed from a message */
+	NOTIFICATION_REMINDER,	/* the registration reminder, see queue.c */
+	NOTIFICATION_DIGEST,	/* sums up a backlog, see digest_unsafe() */
+} notification_kind_t;
+
+/*
+ * A stream of messages coming into the daemon. That's either the pipe
+ * or one of the connections to the socket.
+ */
+typedef struct {
+	int fd;
+	msgbuf_t buf;
+	int reply_fd;	/* -1 if the producer can't be replied to */
+	gboolean ack;	/* the producer wants a reply to every message */
+} ingest_source_t;
+
+/*
+ * Counters describing the work done by the pipe watch on each wakeup.
+ */
+struct ingest_stats {
+	guint64 wakeups;
+	guint64 lines;
+	guint last_batch;
+	guint max_batch;
+	gint64 last_ingest_us;
+	gint64 total_ingest_us;
+
+	guint64 queue_full; /* rejected before being handed over */
+	guint64 oversize; /* over max_message_size */
+
+	guint64 classes[N_MESSAGE_CLASSES]; /* the traffic mix */
+};
+
+/*
+ * What the overflow policies did to the notifications that didn't fit.
+ */
+struct overflow_stats {
+	guint64 dropped_newest;
+	guint64 dropped_oldest;
+	guint64 coalesced;
+};
+
+/*
+ * The notifications spilled by the GTK main loop wait in the outbox until
+ * the ingest thread appends them to the file. Only the ingest thread
+ * touches the file, the offsets and counters are shared under the lock.
+ */
+struct spill {
+	GMutex lock;
+	int fd;
+	gsize read_offset;
+	gsize write_offset;
+	GQueue outbox; /* waiting to be written by the ingest thread */
+
+	guint64 spilled;
+	guint64 unspilled;
+	guint64 lost; /* couldn't be read back */
+};
+
+/*
+ * What the waiting digest sums up. It's rebuilt whenever more
+ * notifications are folded into it.
+ */
+struct digest {
+	struct notification_info *pending; /* queued, NULL if there's none */
+	struct notification_info *shown; /* taken out, the tally is still its */
+	guint count; /* of the notifications folded into it */
+	gint64 expires_at; /* the latest of theirs, 0 if one doesn't expire */
+	GHashTable *types; /* the number of them by type */
+	GHashTable *latest; /* the newest title by category */
+
+	/* The journal entries of the folded notifications by the digest
+	   they went into, including the ones waiting or being shown. */
+	GHashTable *journal;
+};
+
+/*
+ * A notification on the screen. Each of them has a slot with its own
+ * window and timer, the windows are stacked above the panel.
+ */
+typedef struct {
+	struct kano_notifications *plugin_data;
+	struct notification_info *notification; /* NULL if the slot is free */
+	GtkWidget *window;
+	guint window_timeout;
+	guint display_time; /* in seconds */
+	guint64 shown; /* orders the stack, the newest one is at the top */
+} notification_slot_t;
+
 /*
  * The main data structure of the plugin. Kept as plugin_data in
  * the lxpanel's Plugin object.
  */
-typedef struct {
-	int fifo_fd;
+typedef struct kano_notifications {
+	/* Everything here is only used by the ingest thread. */
+	GThread *ingest_thread;
+	GMainContext *ingest_context;
+	GMainLoop *ingest_loop;
+
+	ingest_source_t fifo;
 	GIOChannel *fifo_channel;
-	guint watch_id;
+	GSource *fifo_watch;
+
+	int server_fd;
+	GIOChannel *server_channel;
+	GSource *server_watch; /* NULL while accepting is backed off */
+	GSource *server_retry;
+	GList *clients;
+	guint n_clients;
+
+	/* Parsed notifications on their way to the GTK main loop. */
+	spsc_ring_t handoff;
+	int handoff_fd;
+	GIOChannel *handoff_channel;
+	guint handoff_watch_id;
+
+	/* Whether the registration reminder should be queued. Working it
+	   out runs a command, so the ingest thread only does it every
+	   REMINDER_CHECK_INTERVAL and the queue reads the result. */
+	gint64 reminder_checked_at; /* monotonic time */
+	volatile gint reminder_due;
 
 	gboolean paused;
 
 	GtkWidget *icon;
 
 	GMutex lock;
-	GList *queue;
+	deque_t queues[N_URGENCIES]; /* waiting to be shown, by urgency */
+	volatile gint queue_length; /* can be read without the lock */
+	gsize queue_bytes; /* taken up by the queued notifications */
+	GHashTable *fingerprints; /* the queued notifications by fingerprint */
+	GHashTable *categories; /* the waiting coalescible ones by category */
+	guint64 duplicates; /* not queued because they were already */
+	guint64 superseded; /* replaced by a newer one of the category */
+	guint64 expired; /* dropped before they could be shown */
+	guint expiry_sweep_id;
+	guint64 preempted; /* put back for a critical one */
+	guint64 digested; /* folded into a digest instead of being shown */
+	struct digest digest;
+	struct overflow_stats overflow;
+	struct spill spill;
+	journal_t journal;
+	struct notification_info *reminder; /* parsed once, see init_reminder() */
+	gboolean reminder_out; /* queued or on the screen */
+	guint journal_sync_id;
 
-	GtkWidget *window;
-	guint window_timeout;
+	notification_slot_t slots[MAX_STACK_SIZE];
+	guint64 shown_count;
 
 	int panel_height;
 
 	struct notification_conf conf;
+
+	struct ingest_stats stats;
 } kano_notifications_t;
 
 
 /*
  * Represents a single notification to be displayed.
+ *
+ * A notification is allocated as one block with all of its strings
+ * packed right behind the struct, see pack_notification().
  */
-typedef struct {
-        gboolean free_unparsed; /* unparsed was allocated/static */
-        gchar *unparsed; /* original unparsed notification */
-  
+typedef struct notification_info {
+	gsize size; /* of the whole block in bytes */
+	gchar *unparsed; /* original unparsed notification */
+	guint32 journal_seq; /* 0 if the notification isn't in the journal */
+	notification_kind_t kind;
+	guint64 fingerprint; /* of the content, see pack_notification() */
+	gint urgency; /* one of urgency_t */
+	gint64 queued_at; /* monotonic time */
+	gint64 expires_at; /* real time in seconds, 0 if it doesn't expire */
+	gint ttl; /* in seconds, 0 unless the above was worked out from it */
+	gint timeout; /* how long to show it in seconds, 0 for on_time */
+
 	gchar *title; /* mandatory field */
 	gchar *byline; /* mandatory field */
 
 	gchar *type; /* types: normal, small. If omitted normal is assumed. */
+	gchar *category; /* the id prefix or the type if not given */
 
 	/* The following fields are optional. Some are only supported by
 	   certain types of notifications. */
@@ -84,32 +327,24 @@ typedef struct {
 
 /*
  * A shortcut to freeing the whole notification_info_t function.
+ *
+ * The reminder is shared and is only freed by clear_reminder().
  */
 static inline void free_notification(notification_info_t *data)
 {
-        if(data->free_unparsed){
- 	      g_free(data->unparsed);
-        }
-	g_free(data->image_path);
-	g_free(data->title);
-	g_free(data->byline);
-	g_free(data->command);
-	g_free(data->sound);
-	g_free(data->type);
-
-	g_free(data->button1_label);
-	g_free(data->button1_command);
-	g_free(data->button1_colour);
-	g_free(data->button1_hover);
-
-	g_free(data->button2_label);
-	g_free(data->button2_command);
-	g_free(data->button2_colour);
-	g_free(data->button2_hover);
+	if (data && data->kind == NOTIFICATION_REMINDER)
+		return;
 
 	g_free(data);
 }
 
-notification_info_t *get_json_notification(gchar *json_data, gboolean free_unparsed);
+notification_info_t *pack_notification(const notification_info_t *draft);
+guint64 fingerprint_message(const gchar *msg);
+notification_info_t *get_json_notification(const gchar *json_data);
+message_class_t classify_message(const gchar *msg);
+notification_info_t *parse_notification(gchar *msg);
+gchar *save_message(const notification_info_t *data);
+notification_info_t *parse_saved_message(gchar *msg);
+gssize ingest_source(kano_notifications_t *plugin_data, ingest_source_t *src);
 
 #endif
@@ -0,0 +1,347 @@
+/*
+ * prefixes.c
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * Every prefix maps to the title, byline, image, sound and command of
+ * the notification. The byline and the image are templates in which {N}
+ * is replaced by the Nth part of the id, starting with the prefix at 0.
+ * Without a byline template, the byline is the title of the award named
+ * by the id in the kano-profile rules.
+ *
+ * The built-in prefixes can be extended or overridden in PREFIXES_FILENAME,
+ * for example:
+ *
+ * {
+ *     "challenges": {
+ *         "title": "New challenge!",
+ *         "image": "/usr/share/kano-profile/media/images/{0}/{1}/{2}.png",
+ *         "sound": "/usr/share/kano-media/sounds/kano_level_up.wav",
+ *         "command": "kano-profile-gui",
+ *         "login_command": "kano-login 3"
+ *     }
+ * }
+ *
+ * The login command replaces the command while the user isn't registered
+ * in kano world. The table is set up before the ingest thread starts and
+ * never changes afterwards, so it's read without a lock.
+ *
+ */
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "parson/parson.h"
+#include "config.h"
+#include "notifications.h"
+#include "prefixes.h"
+#include "rules.h"
+#include "ui.h"
+
+
+#define __STR_HELPER(x) #x
+#define STR(x) __STR_HELPER(x)
+
+#define CHEER_SOUND "/usr/share/kano-media/sounds/kano_level_up.wav"
+
+#define IMG_BASE_PATH "/usr/share/kano-profile/media/images/{0}/" \
+	STR(NOTIFICATION_IMAGE_WIDTH) "x" STR(NOTIFICATION_IMAGE_HEIGHT)
+
+#define KANO_PROFILE_CMD "kano-profile-gui"
+#define KANO_LOGIN_CMD "kano-login 3"
+
+typedef struct {
+	gchar *title;
+	gchar *byline;		/* NULL for the title of the award */
+	gchar *image;
+	gchar *sound;
+	gchar *command;
+	gchar *login_command;	/* used while the user isn't registered */
+	guint min_tokens;	/* the id needs at least this many parts */
+} id_prefix_t;
+
+static const struct {
+	const gchar *prefix;
+	id_prefix_t rule;
+} default_prefixes[] = {
+	{ "level", { "New level!", "You're now Level {1}",
+		     IMG_BASE_PATH "/Level-{1}.png", CHEER_SOUND,
+		     NULL, NULL, 2 } },
+	{ "badges", { "New badge!", NULL,
+		      IMG_BASE_PATH "/{1}/{2}_levelup.png", CHEER_SOUND,
+		      KANO_PROFILE_CMD, KANO_LOGIN_CMD, 3 } },
+	{ "environments", { "New environment!", NULL,
+			    IMG_BASE_PATH "/{1}/{2}_levelup.png", CHEER_SOUND,
+			    KANO_PROFILE_CMD, KANO_LOGIN_CMD, 3 } },
+	/* There's a path exception for avatars. */
+	{ "avatars", { "New avatar!", NULL,
+		       IMG_BASE_PATH "/{1}/{1}_levelup.png", CHEER_SOUND,
+		       KANO_PROFILE_CMD, KANO_LOGIN_CMD, 3 } },
+};
+
+/* prefix -> id_prefix_t */
+static GHashTable *prefixes = NULL;
+
+
+static void free_prefix(gpointer data)
+{
+	id_prefix_t *rule = (id_prefix_t *)data;
+
+	g_free(rule->title);
+	g_free(rule->byline);
+	g_free(rule->image);
+	g_free(rule->sound);
+	g_free(rule->command);
+	g_free(rule->login_command);
+	g_free(rule);
+}
+
+static void add_prefix(const gchar *prefix, const id_prefix_t *template)
+{
+	id_prefix_t *rule = g_new0(id_prefix_t, 1);
+
+	rule->title = g_strdup(template->title);
+	rule->byline = g_strdup(template->byline);
+	rule->image = g_strdup(template->image);
+	rule->sound = g_strdup(template->sound);
+	rule->command = g_strdup(template->command);
+	rule->login_command = g_strdup(template->login_command);
+	rule->min_tokens = template->min_tokens;
+
+	g_hash_table_replace(prefixes, g_strdup(prefix), rule);
+}
+
+/*
+ * Check that a template only refers to tokens an id can have, see
+ * expand_template().
+ */
+static gboolean is_valid_template(const gchar *template)
+{
+	const gchar *p;
+
+	if (!template)
+		return TRUE;
+
+	for (p = template; *p; p++) {
+		if (p[0] == '{' && g_ascii_isdigit(p[1]) && p[2] == '}' &&
+		    p[1] - '0' >= ID_MAX_TOKENS)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Add the prefixes from the configuration file, if there is one. The
+ * entries that couldn't be applied to an id are skipped.
+ */
+static void load_prefixes(const gchar *filename)
+{
+	JSON_Value *root_value = NULL;
+	JSON_Object *root = NULL;
+	JSON_Object *object = NULL;
+	id_prefix_t rule;
+	const gchar *prefix;
+	gdouble min_tokens;
+	gsize i, count;
+
+	if (access(filename, F_OK) == -1)
+		return;
+
+	root_value = json_parse_file(filename);
+	if (json_value_get_type(root_value) != JSONObject) {
+		json_value_free(root_value);
+		return;
+	}
+
+	root = json_value_get_object(root_value);
+	count = json_object_get_count(root);
+	for (i = 0; i < count; i++) {
+		prefix = json_object_get_name(root, i);
+		object = json_value_get_object(json_object_get_value_at(root, i));
+
+		rule.title = (gchar *)json_object_get_string(object, "title");
+		if (!rule.title)
+			continue;
+
+		rule.byline = (gchar *)json_object_get_string(object, "byline");
+		rule.image = (gchar *)json_object_get_string(object, "image");
+		rule.sound = (gchar *)json_object_get_string(object, "sound");
+		rule.command = (gchar *)json_object_get_string(object, "command");
+		rule.login_command = (gchar *)json_object_get_string(object,
+							"login_command");
+
+		if (!is_valid_template(rule.byline) ||
+		    !is_valid_template(rule.image)) {
+			fprintf(stderr, "Skipping prefix %s, a template uses "
+				"more than %d tokens\n", prefix, ID_MAX_TOKENS);
+			continue;
+		}
+
+		/* Looking up an award needs all three parts. */
+		min_tokens = json_object_get_number(object, "min_tokens");
+		if (min_tokens == 0) {
+			rule.min_tokens = rule.byline ? 2 : 3;
+		} else if (min_tokens >= 1 && min_tokens <= ID_MAX_TOKENS &&
+			   min_tokens == (guint)min_tokens) {
+			rule.min_tokens = min_tokens;
+		} else {
+			fprintf(stderr, "Skipping prefix %s, min_tokens must be "
+				"a whole number from 1 to %d\n", prefix,
+				ID_MAX_TOKENS);
+			continue;
+		}
+
+		add_prefix(prefix, &rule);
+	}
+
+	json_value_free(root_value);
+}
+
+void init_prefixes(void)
+{
+	guint i;
+
+	prefixes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					 free_prefix);
+
+	for (i = 0; i < G_N_ELEMENTS(default_prefixes); i++)
+		add_prefix(default_prefixes[i].prefix, &(default_prefixes[i].rule));
+
+	load_prefixes(PREFIXES_FILENAME);
+}
+
+void clear_prefixes(void)
+{
+	g_hash_table_destroy(prefixes);
+	prefixes = NULL;
+}
+
+/*
+ * Replace every {N} in the template with the Nth token of the id.
+ *
+ * Returns FALSE if the result doesn't fit into the buffer.
+ */
+static gboolean expand_template(gchar *out, gsize size, const gchar *template,
+				gchar **tokens, guint n_tokens)
+{
+	const gchar *p = template;
+	gsize pos = 0, len;
+	guint index;
+
+	while (*p) {
+		if (p[0] == '{' && g_ascii_isdigit(p[1]) && p[2] == '}') {
+			/* Missing tokens expand to nothing. */
+			index = p[1] - '0';
+			if (index < n_tokens) {
+				len = strlen(tokens[index]);
+				if (pos + len >= size)
+					return FALSE;
+
+				memcpy(out + pos, tokens[index], len);
+				pos += len;
+			}
+			p += 3;
+			continue;
+		}
+
+		if (pos + 1 >= size)
+			return FALSE;
+
+		out[pos++] = *p++;
+	}
+
+	out[pos] = '\0';
+	return TRUE;
+}
+
+/*
+ * Prepare a notification_t instance to be displayed based on an id
+ * for it. The format of the id is the following:
+ *
+ *  - level:5
+ *  - badges:application:feedbacker
+ *  - avatars:conductor:conductor_1
+ *
+ * The id is split on a copy on the stack, nothing is allocated before
+ * it's clear the id is valid.
+ *
+ * TODO: Now that the widget supports JSON notifications, this logic
+ *       could be moved outside of the widget itself.
+ */
+notification_info_t *get_notification_by_id(const gchar *id)
+{
+	gchar buffer[ID_MAX_LEN];
+	gchar *tokens[ID_MAX_TOKENS];
+	gchar byline[ID_MAX_EXPANDED_LEN];
+	gchar image_path[ID_MAX_EXPANDED_LEN];
+	gchar *award_title = NULL;
+	notification_info_t draft = { 0 };
+	notification_info_t *data;
+	const id_prefix_t *rule;
+	guint n_tokens = 0;
+	gsize len = strlen(id);
+	gchar *p;
+
+	if (len >= sizeof(buffer))
+		return NULL;
+
+	memcpy(buffer, id, len + 1);
+
+	tokens[n_tokens++] = buffer;
+	for (p = buffer; *p && n_tokens < ID_MAX_TOKENS; p++) {
+		if (*p == ':') {
+			*p = '\0';
+			tokens[n_tokens++] = p + 1;
+		}
+	}
+
+	rule = g_hash_table_lookup(prefixes, tokens[0]);
+	if (!rule || n_tokens < rule->min_tokens)
+		return NULL;
+
+	draft.unparsed = (gchar *)id;
+	draft.urgency = URGENCY_NORMAL;
+	draft.category = tokens[0];
+	draft.title = rule->title;
+	draft.sound = rule->sound;
+
+	if (rule->byline) {
+		if (!expand_template(byline, sizeof(byline), rule->byline,
+				     tokens, n_tokens))
+			return NULL;
+		draft.byline = byline;
+	} else if (n_tokens >= 3) {
+		/* Load award title */
+		award_title = lookup_award_title(tokens[0], tokens[1], tokens[2]);
+		draft.byline = award_title;
+	}
+
+	if (!draft.byline)
+		return NULL;
+
+	if (rule->image) {
+		if (!expand_template(image_path, sizeof(image_path), rule->image,
+				     tokens, n_tokens)) {
+			g_free(award_title);
+			return NULL;
+		}
+		draft.image_path = image_path;
+	}
+
+	/* The command depends on whether the user is logged in to kano
+	   world or not. */
+	if (rule->login_command && !is_user_registered())
+		draft.command = rule->login_command;
+	else
+		draft.command = rule->command;
+
+	data = pack_notification(&draft);
+	g_free(award_title);
+
+	return data;
+}
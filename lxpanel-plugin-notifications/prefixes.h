@@ -0,0 +1,34 @@
+/*
+ * prefixes.h
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * Notifications sent as ids, e.g. level:5 or badges:application:feedbacker.
+ * What each kind of id turns into is decided by its prefix.
+ *
+ */
+
+#include <glib.h>
+
+#include "notifications.h"
+
+#ifndef notif_prefixes_h
+#define notif_prefixes_h
+
+/* Adds to or overrides the built-in prefixes. */
+#define PREFIXES_FILENAME "/etc/kano-notifications/prefixes.json"
+
+/* Longer ids are rejected, they're copied to the stack to be split. */
+#define ID_MAX_LEN 256
+#define ID_MAX_TOKENS 8
+
+/* The longest a byline or image path can get after expanding it. */
+#define ID_MAX_EXPANDED_LEN 512
+
+void init_prefixes(void);
+void clear_prefixes(void);
+
+notification_info_t *get_notification_by_id(const gchar *id);
+
+#endif
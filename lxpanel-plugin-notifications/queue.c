@@ -0,0 +1,1432 @@
+/*
+ * queue.c
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * The queue is owned by the GTK main loop and all the functions with the
+ * _unsafe suffix expect the caller to hold plugin_data->lock.
+ *
+ * Every queued notification is also recorded in the journal until it's
+ * removed from the queue again, so the queue can be restored after the
+ * daemon restarts.
+ *
+ * There's a queue for each urgency level and the next notification to be
+ * shown is taken from the most urgent one, see
+ * take_next_notification_unsafe().
+ * A low urgency notification that has been waiting for a while competes
+ * with the normal ones, so it can't be held back forever. A critical one
+ * takes the place of the least urgent notification on the screen if
+ * there's no room for it.
+ *
+ * A notification with the same content as one that's queued already is
+ * dropped, it would only be shown twice in a row. They are told apart
+ * by their fingerprints. A newer notification of a coalescible category,
+ * e.g. a level up, takes the place of the waiting one it supersedes.
+ *
+ * Notifications that have expired while waiting are dropped when they get
+ * to the front of their queue, and by a periodic sweep for the rest.
+ *
+ * Once more than digest_threshold low and normal urgency notifications
+ * are waiting, they are folded into a single digest that sums them up,
+ * see digest_unsafe(). They are freed right away, so a flood costs one
+ * window rather than one for each of them. Their journal entries are
+ * kept until the digest is gone, so they're folded again after a
+ * restart.
+ *
+ * When the queue is full, the configured overflow policy decides what
+ * happens to the incoming notification. Spilled notifications are written
+ * to a file in the binary framing of msgbuf.h and read back by the ingest
+ * thread whenever there's room in the queue again.
+ *
+ */
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "config.h"
+#include "notifications.h"
+#include "queue.h"
+#include "ingest.h"
+#include "ui.h"
+
+/* A low urgency notification waiting longer than this counts as normal. */
+#define URGENCY_AGING_US (5 * 60 * G_USEC_PER_SEC)
+
+/* Past this many seconds' worth of min_on_time waiting, the time each
+   notification is shown for goes below min_on_time. */
+#define DRAIN_BUDGET (10 * 60)
+
+/* How often the queues are checked for expired notifications. */
+#define EXPIRY_SWEEP_INTERVAL 60 /* seconds */
+
+/* The digest lists the newest title of this many categories at most. */
+#define DIGEST_MAX_CATEGORIES 4
+
+/* Passed on to the speaker LEDs in place of the original message. */
+#define DIGEST_UNPARSED "{\"category\": \"digest\"}"
+
+/*
+ * The newest title of a category folded into the digest.
+ */
+struct digest_title {
+	gint64 queued_at;
+	gchar title[];
+};
+
+
+/*
+ * The notifications waiting to be shown.
+ */
+static guint queue_waiting_unsafe(kano_notifications_t *plugin_data)
+{
+	guint count = 0;
+	guint urgency;
+
+	for (urgency = 0; urgency < N_URGENCIES; urgency++)
+		count += deque_length(&(plugin_data->queues[urgency]));
+
+	return count;
+}
+
+/*
+ * All the queued notifications, including the ones being shown.
+ */
+static guint queue_count_unsafe(kano_notifications_t *plugin_data)
+{
+	guint count = queue_waiting_unsafe(plugin_data);
+	guint i;
+
+	for (i = 0; i < MAX_STACK_SIZE; i++)
+		if (plugin_data->slots[i].notification)
+			count++;
+
+	return count;
+}
+
+/*
+ * The registration reminder is parsed once by init_reminder() and the same
+ * notification is queued every time. Telling it apart is a matter of
+ * checking its kind, and freeing it is a no-op.
+ *
+ * It's queued as a low urgency notification, so it comes after all the
+ * others.
+ */
+static gboolean is_last_element_reminder(kano_notifications_t *plugin_data)
+{
+	notification_info_t *last =
+		deque_peek_tail(&(plugin_data->queues[URGENCY_LOW]));
+
+	return last != NULL && last->kind == NOTIFICATION_REMINDER;
+}
+
+static void append_reminder_to_q(kano_notifications_t *plugin_data)
+{
+	notification_info_t *notif = plugin_data->reminder;
+
+	/* There's only one of it, so it can't be queued again while it's
+	   waiting or in one of the slots. */
+	if (notif == NULL || plugin_data->reminder_out)
+		return;
+
+	/* Worked out by the ingest thread, see check_reminder_due(). */
+	if (g_atomic_int_get(&(plugin_data->reminder_due))) {
+		deque_push_tail(&(plugin_data->queues[URGENCY_LOW]), notif);
+		plugin_data->queue_bytes += notif->size;
+		plugin_data->reminder_out = TRUE;
+	}
+}
+
+/*
+ * Returns whether a notification with the same content is queued.
+ */
+static gboolean is_duplicate_unsafe(kano_notifications_t *plugin_data,
+				    notification_info_t *data)
+{
+	return data->kind == NOTIFICATION_REGULAR &&
+	       g_hash_table_contains(plugin_data->fingerprints,
+				     &(data->fingerprint));
+}
+
+/*
+ * Returns whether a newer notification of the same category replaces
+ * a waiting one. It only depends on the conf, so it doesn't need the
+ * lock.
+ */
+gboolean is_coalescible(kano_notifications_t *plugin_data,
+			notification_info_t *data)
+{
+	gchar **category = plugin_data->conf.coalesce_categories;
+
+	if (data->kind != NOTIFICATION_REGULAR || !data->category || !category)
+		return FALSE;
+
+	for (; *category; category++)
+		if (strcmp(*category, data->category) == 0)
+			return TRUE;
+
+	return FALSE;
+}
+
+/*
+ * Add a queued notification to the lookup tables. The keys point into
+ * the notification itself, so the entries must go before the
+ * notification does.
+ */
+static void index_notification_unsafe(kano_notifications_t *plugin_data,
+				      notification_info_t *data)
+{
+	if (data->kind != NOTIFICATION_REGULAR)
+		return;
+
+	g_hash_table_insert(plugin_data->fingerprints, &(data->fingerprint),
+			    data);
+
+	if (is_coalescible(plugin_data, data))
+		g_hash_table_replace(plugin_data->categories, data->category,
+				     data);
+}
+
+/*
+ * Only waiting notifications can be superseded.
+ */
+static void forget_category_unsafe(kano_notifications_t *plugin_data,
+				   notification_info_t *data)
+{
+	if (data->category &&
+	    g_hash_table_lookup(plugin_data->categories, data->category) == data)
+		g_hash_table_remove(plugin_data->categories, data->category);
+}
+
+static void unindex_notification_unsafe(kano_notifications_t *plugin_data,
+					notification_info_t *data)
+{
+	if (g_hash_table_lookup(plugin_data->fingerprints,
+				&(data->fingerprint)) == data)
+		g_hash_table_remove(plugin_data->fingerprints,
+				    &(data->fingerprint));
+
+	forget_category_unsafe(plugin_data, data);
+}
+
+/*
+ * Start the next digest from scratch, the waiting one is gone.
+ */
+static void forget_digest_unsafe(kano_notifications_t *plugin_data)
+{
+	struct digest *digest = &(plugin_data->digest);
+
+	digest->pending = NULL;
+	digest->shown = NULL;
+	digest->count = 0;
+	digest->expires_at = 0;
+	g_hash_table_remove_all(digest->types);
+	g_hash_table_remove_all(digest->latest);
+}
+
+/*
+ * The notifications in a digest stay in the journal until the digest is
+ * gone, so they're replayed and folded again after a restart.
+ */
+static void complete_digest_unsafe(kano_notifications_t *plugin_data,
+				   notification_info_t *digest)
+{
+	GArray *seqs = g_hash_table_lookup(plugin_data->digest.journal, digest);
+	guint i;
+
+	if (!seqs)
+		return;
+
+	for (i = 0; i < seqs->len; i++)
+		journal_complete(&(plugin_data->journal),
+				 g_array_index(seqs, guint32, i));
+
+	g_hash_table_remove(plugin_data->digest.journal, digest);
+}
+
+/*
+ * Free a notification that leaves the queue for good.
+ */
+static void discard_notification_unsafe(kano_notifications_t *plugin_data,
+					notification_info_t *data)
+{
+	if (data == plugin_data->digest.pending)
+		forget_digest_unsafe(plugin_data);
+	else if (data == plugin_data->digest.shown)
+		plugin_data->digest.shown = NULL;
+
+	if (data->kind == NOTIFICATION_REMINDER)
+		plugin_data->reminder_out = FALSE;
+
+	if (data->kind == NOTIFICATION_DIGEST)
+		complete_digest_unsafe(plugin_data, data);
+
+	unindex_notification_unsafe(plugin_data, data);
+	journal_complete(&(plugin_data->journal), data->journal_seq);
+	free_notification(data);
+}
+
+/*
+ * Make sure the notification is recorded in the journal.
+ */
+static void journal_notification_unsafe(kano_notifications_t *plugin_data,
+					notification_info_t *data)
+{
+	gchar *saved;
+
+	if (data->journal_seq != 0)
+		return;
+
+	saved = save_message(data);
+	data->journal_seq = journal_append(&(plugin_data->journal), saved,
+					   strlen(saved));
+	g_free(saved);
+}
+
+/*
+ * Drop the oldest waiting notification of the lowest urgency there is,
+ * as long as that's below the given one.
+ */
+static gboolean drop_oldest_unsafe(kano_notifications_t *plugin_data,
+				   urgency_t below)
+{
+	notification_info_t *oldest = NULL;
+	guint urgency;
+
+	for (urgency = 0; urgency < below && !oldest; urgency++)
+		oldest = deque_pop_head(&(plugin_data->queues[urgency]));
+
+	if (!oldest)
+		return FALSE;
+
+	plugin_data->queue_bytes -= oldest->size;
+	discard_notification_unsafe(plugin_data, oldest);
+	plugin_data->overflow.dropped_oldest++;
+
+	return TRUE;
+}
+
+/*
+ * Put a new notification in the place of a waiting one, which is freed.
+ * It counts as waiting since the old one was queued.
+ */
+static void replace_queued_unsafe(kano_notifications_t *plugin_data,
+				  deque_t *queue, guint index,
+				  notification_info_t *data)
+{
+	notification_info_t *queued = deque_nth(queue, index);
+
+	data->queued_at = queued->queued_at;
+	plugin_data->queue_bytes += data->size - queued->size;
+	discard_notification_unsafe(plugin_data, queued);
+	journal_notification_unsafe(plugin_data, data);
+	index_notification_unsafe(plugin_data, data);
+	deque_set_nth(queue, index, data);
+}
+
+/*
+ * Replace the oldest waiting notification of the same type and urgency
+ * with the new one. It keeps its place in the queue.
+ */
+static gboolean coalesce_unsafe(kano_notifications_t *plugin_data,
+				notification_info_t *data)
+{
+	deque_t *queue = &(plugin_data->queues[data->urgency]);
+	notification_info_t *queued;
+	guint i;
+
+	for (i = 0; i < deque_length(queue); i++) {
+		queued = deque_nth(queue, i);
+
+		if (queued->kind != NOTIFICATION_REGULAR)
+			continue;
+
+		if (g_strcmp0(queued->type, data->type) == 0) {
+			replace_queued_unsafe(plugin_data, queue, i, data);
+			plugin_data->overflow.coalesced++;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * A newer notification of a coalescible category replaces the waiting
+ * one of the same category in place, e.g. there's no point in showing
+ * level 3 and 4 once the user is on level 5.
+ *
+ * Returns TRUE if it took the place of the old one. If their urgency
+ * differs the old one is only dropped and the new one is queued as
+ * usual.
+ */
+static gboolean supersede_unsafe(kano_notifications_t *plugin_data,
+				 notification_info_t *data)
+{
+	notification_info_t *queued;
+	deque_t *queue;
+	guint i;
+
+	if (!is_coalescible(plugin_data, data))
+		return FALSE;
+
+	queued = g_hash_table_lookup(plugin_data->categories, data->category);
+	if (!queued)
+		return FALSE;
+
+	queue = &(plugin_data->queues[queued->urgency]);
+	for (i = 0; i < deque_length(queue); i++)
+		if (deque_nth(queue, i) == queued)
+			break;
+
+	if (i == deque_length(queue))
+		return FALSE;
+
+	plugin_data->superseded++;
+	g_debug("queue: %s superseded (%" G_GUINT64_FORMAT " so far)",
+		data->category, plugin_data->superseded);
+
+	if (queued->urgency == data->urgency) {
+		replace_queued_unsafe(plugin_data, queue, i, data);
+		return TRUE;
+	}
+
+	deque_remove(queue, i);
+	plugin_data->queue_bytes -= queued->size;
+	discard_notification_unsafe(plugin_data, queued);
+
+	return FALSE;
+}
+
+/*
+ * Append the original message of the notification to the spill file.
+ * Only the ingest thread touches the file, so the offsets only need the
+ * lock when they change.
+ *
+ * Returns FALSE if it couldn't be written.
+ */
+static gboolean write_spill(struct spill *spill, notification_info_t *data)
+{
+	guchar header[MSGBUF_MAX_HEADER_LEN];
+	struct iovec iov[2];
+	gchar *saved;
+	gsize len;
+	gssize written;
+
+	if (spill->fd < 0)
+		return FALSE;
+
+	saved = save_message(data);
+	len = strlen(saved);
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = msgbuf_frame_header(header, len);
+	iov[1].iov_base = saved;
+	iov[1].iov_len = len;
+
+	written = writev(spill->fd, iov, 2);
+	g_free(saved);
+
+	if (written == (gssize)(iov[0].iov_len + len)) {
+		g_mutex_lock(&(spill->lock));
+		spill->write_offset += written;
+		spill->spilled++;
+		g_mutex_unlock(&(spill->lock));
+		return TRUE;
+	}
+
+	if (written < 0)
+		perror("writev");
+	else
+		fprintf(stderr, "Short write to the spill file\n");
+
+	/* A partial frame would throw off the framing of everything
+	   appended after it. */
+	if (written > 0 && ftruncate(spill->fd, spill->write_offset) < 0)
+		perror("ftruncate");
+
+	return FALSE;
+}
+
+/*
+ * Runs on the ingest thread. Write out the notifications spilled by the
+ * queue and free them, they are parsed again when they're read back.
+ */
+static gboolean flush_spill_cb(gpointer data)
+{
+	kano_notifications_t *plugin_data = (kano_notifications_t *)data;
+	struct spill *spill = &(plugin_data->spill);
+	notification_info_t *notification;
+	gboolean written;
+
+	while (TRUE) {
+		g_mutex_lock(&(spill->lock));
+		notification = g_queue_pop_head(&(spill->outbox));
+		g_mutex_unlock(&(spill->lock));
+
+		if (!notification)
+			break;
+
+		/* It's on disk now, a restart reads it back from there.
+		   Otherwise it's dropped like with no spill file at all,
+		   only the journal still has it, if it was in there. */
+		written = write_spill(spill, notification);
+
+		g_mutex_lock(&(plugin_data->lock));
+		if (written)
+			journal_complete(&(plugin_data->journal),
+					 notification->journal_seq);
+		else
+			plugin_data->overflow.dropped_newest++;
+		g_mutex_unlock(&(plugin_data->lock));
+
+		free_notification(notification);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+/*
+ * Runs on the ingest thread. Write a notification that couldn't even be
+ * handed over straight to the spill file, it's read back with the rest.
+ * Not to be called while the spill is being read back, that holds the
+ * spill lock for the whole read.
+ *
+ * Returns FALSE if it couldn't be written, the notification is left to
+ * the caller either way.
+ */
+gboolean spill_notification(kano_notifications_t *plugin_data,
+			    notification_info_t *data)
+{
+	return write_spill(&(plugin_data->spill), data);
+}
+
+/*
+ * Move the notification out to the spill file. The writing is left to
+ * the ingest thread, so the GTK main loop never waits for the disk.
+ */
+static gboolean spill_unsafe(kano_notifications_t *plugin_data,
+			     notification_info_t *data)
+{
+	struct spill *spill = &(plugin_data->spill);
+	GSource *source;
+
+	if (spill->fd < 0)
+		return FALSE;
+
+	unindex_notification_unsafe(plugin_data, data);
+
+	g_mutex_lock(&(spill->lock));
+	g_queue_push_tail(&(spill->outbox), data);
+	g_mutex_unlock(&(spill->lock));
+
+	/* Not g_main_context_invoke(), that could run it right here with
+	   the lock held if the ingest thread isn't running. */
+	source = g_idle_source_new();
+	g_source_set_callback(source, flush_spill_cb, plugin_data, NULL);
+	g_source_attach(source, plugin_data->ingest_context);
+	g_source_unref(source);
+
+	return TRUE;
+}
+
+/*
+ * Apply the overflow policy to a notification that doesn't fit into the
+ * queue.
+ *
+ * Returns TRUE if the notification has been dealt with, FALSE if room was
+ * made for it and it should be queued as usual.
+ */
+static gboolean handle_overflow_unsafe(kano_notifications_t *plugin_data,
+				       notification_info_t *data,
+				       ingest_status_t *status)
+{
+	gboolean done = FALSE;
+
+	*status = INGEST_OK;
+
+	/* Critical notifications get in at the expense of the others,
+	   whatever the policy. */
+	if (data->urgency == URGENCY_CRITICAL &&
+	    drop_oldest_unsafe(plugin_data, URGENCY_CRITICAL))
+		return FALSE;
+
+	switch (plugin_data->conf.overflow_policy) {
+	case OVERFLOW_DROP_OLDEST:
+		if (drop_oldest_unsafe(plugin_data, N_URGENCIES))
+			return FALSE;
+		break;
+	case OVERFLOW_COALESCE_BY_TYPE:
+		done = coalesce_unsafe(plugin_data, data);
+		break;
+	case OVERFLOW_SPILL_TO_DISK:
+		done = spill_unsafe(plugin_data, data);
+		break;
+	default:
+		break;
+	}
+
+	/* Everything else falls back to dropping the new one. */
+	if (!done) {
+		discard_notification_unsafe(plugin_data, data);
+		plugin_data->overflow.dropped_newest++;
+		*status = INGEST_QUEUE_FULL;
+	}
+
+	g_debug("overflow: %s (dropped newest %" G_GUINT64_FORMAT
+		", dropped oldest %" G_GUINT64_FORMAT
+		", coalesced %" G_GUINT64_FORMAT ")",
+		overflow_policy_to_string(plugin_data->conf.overflow_policy),
+		plugin_data->overflow.dropped_newest,
+		plugin_data->overflow.dropped_oldest,
+		plugin_data->overflow.coalesced);
+
+	return TRUE;
+}
+
+/*
+ * Count a notification that is folded into the digest.
+ */
+static void tally_digest(struct digest *digest, notification_info_t *data)
+{
+	const gchar *type = data->type ? data->type : "normal";
+	const gchar *category = data->category ? data->category : type;
+	struct digest_title *latest;
+	guint count;
+
+	/* It's not worth showing once the last of them has expired. */
+	if (digest->count == 0)
+		digest->expires_at = data->expires_at;
+	else if (data->expires_at == 0 || digest->expires_at == 0)
+		digest->expires_at = 0;
+	else
+		digest->expires_at = MAX(digest->expires_at, data->expires_at);
+
+	count = GPOINTER_TO_UINT(g_hash_table_lookup(digest->types, type));
+	g_hash_table_replace(digest->types, g_strdup(type),
+			     GUINT_TO_POINTER(count + 1));
+
+	latest = g_hash_table_lookup(digest->latest, category);
+	if (!latest || latest->queued_at <= data->queued_at) {
+		latest = g_malloc(sizeof(struct digest_title) +
+				  strlen(data->title) + 1);
+		latest->queued_at = data->queued_at;
+		strcpy(latest->title, data->title);
+		g_hash_table_replace(digest->latest, g_strdup(category),
+				     latest);
+	}
+
+	digest->count++;
+}
+
+/*
+ * Make a notification out of the tally, e.g.
+ *
+ *     23 new notifications
+ *     21 normal, 2 small
+ *     badges: Bug Squasher
+ *     level: Level 5
+ */
+static notification_info_t *build_digest(struct digest *digest)
+{
+	notification_info_t draft = { 0 };
+	notification_info_t *data;
+	GString *byline = g_string_new(NULL);
+	struct digest_title *latest;
+	GList *keys, *key;
+	gchar *title;
+	guint n;
+
+	keys = g_list_sort(g_hash_table_get_keys(digest->types),
+			   (GCompareFunc) strcmp);
+	for (key = keys; key; key = key->next)
+		g_string_append_printf(byline, "%s%u %s",
+			key == keys ? "" : ", ",
+			GPOINTER_TO_UINT(g_hash_table_lookup(digest->types,
+							     key->data)),
+			(gchar *)key->data);
+	g_list_free(keys);
+
+	keys = g_list_sort(g_hash_table_get_keys(digest->latest),
+			   (GCompareFunc) strcmp);
+	for (key = keys, n = 0; key && n < DIGEST_MAX_CATEGORIES;
+	     key = key->next, n++) {
+		latest = g_hash_table_lookup(digest->latest, key->data);
+		g_string_append_printf(byline, "\n%s: %s", (gchar *)key->data,
+				       latest->title);
+	}
+	if (key)
+		g_string_append_printf(byline, "\nand %u more",
+				       g_list_length(key));
+	g_list_free(keys);
+
+	title = g_strdup_printf("%u new notifications", digest->count);
+
+	draft.unparsed = DIGEST_UNPARSED;
+	draft.kind = NOTIFICATION_DIGEST;
+	draft.urgency = URGENCY_NORMAL;
+	draft.title = title;
+	draft.byline = byline->str;
+	draft.type = "small";
+	draft.category = "digest";
+
+	data = pack_notification(&draft);
+	g_free(title);
+	g_string_free(byline, TRUE);
+
+	return data;
+}
+
+/*
+ * Fold the waiting low and normal urgency notifications into the digest
+ * once there are more than digest_threshold of them. Critical ones and
+ * the reminder keep their place.
+ *
+ * The notifications are freed and the digest takes the place of the
+ * waiting one, or goes to the front of the normal queue if there's none.
+ * It's rebuilt each time, so it always sums up all of them.
+ */
+static void digest_unsafe(kano_notifications_t *plugin_data)
+{
+	struct digest *digest = &(plugin_data->digest);
+	notification_info_t *data, *previous = digest->pending;
+	gint64 oldest = G_MAXINT64;
+	guint urgency, i, n, folded = 0;
+	GArray *seqs = NULL;
+	deque_t *queue;
+
+	if (plugin_data->conf.digest_threshold == 0 ||
+	    deque_length(&(plugin_data->queues[URGENCY_LOW])) +
+	    deque_length(&(plugin_data->queues[URGENCY_NORMAL])) <=
+	    plugin_data->conf.digest_threshold)
+		return;
+
+	/* Carried over from the waiting digest, if there's one. */
+	if (previous) {
+		seqs = g_hash_table_lookup(digest->journal, previous);
+		g_hash_table_steal(digest->journal, previous);
+	}
+	if (!seqs)
+		seqs = g_array_new(FALSE, FALSE, sizeof(guint32));
+
+	for (urgency = URGENCY_LOW; urgency < URGENCY_CRITICAL; urgency++) {
+		queue = &(plugin_data->queues[urgency]);
+		n = deque_length(queue);
+
+		/* Whatever stays goes back in the same order. */
+		for (i = 0; i < n; i++) {
+			data = deque_pop_head(queue);
+			if (data->kind != NOTIFICATION_REGULAR) {
+				deque_push_tail(queue, data);
+				continue;
+			}
+
+			/* The tally of one that was shown is kept in case
+			   it comes back, a new digest starts from scratch. */
+			if (!previous && folded == 0)
+				forget_digest_unsafe(plugin_data);
+
+			oldest = MIN(oldest, data->queued_at);
+			tally_digest(digest, data);
+
+			/* Its journal entry now belongs to the digest. */
+			if (data->journal_seq != 0)
+				g_array_append_val(seqs, data->journal_seq);
+			data->journal_seq = 0;
+
+			plugin_data->queue_bytes -= data->size;
+			discard_notification_unsafe(plugin_data, data);
+			folded++;
+		}
+	}
+
+	if (folded == 0) {
+		if (previous)
+			g_hash_table_insert(digest->journal, previous, seqs);
+		else
+			g_array_unref(seqs);
+		return;
+	}
+
+	data = build_digest(digest);
+	data->queued_at = oldest;
+	data->expires_at = digest->expires_at;
+	plugin_data->queue_bytes += data->size;
+	g_hash_table_insert(digest->journal, data, seqs);
+
+	queue = &(plugin_data->queues[URGENCY_NORMAL]);
+	for (i = 0; previous && i < deque_length(queue); i++)
+		if (deque_nth(queue, i) == previous)
+			break;
+
+	if (previous && i < deque_length(queue)) {
+		data->queued_at = MIN(oldest, previous->queued_at);
+		deque_set_nth(queue, i, data);
+
+		/* Keep the tally, it's carried over to the new one. */
+		digest->pending = NULL;
+		plugin_data->queue_bytes -= previous->size;
+		discard_notification_unsafe(plugin_data, previous);
+	} else {
+		deque_insert(queue, 0, data);
+	}
+
+	digest->pending = data;
+	plugin_data->digested += folded;
+	g_debug("queue: %u notifications in the digest (%" G_GUINT64_FORMAT
+		" so far)", digest->count, plugin_data->digested);
+
+	/* There's room for the spilled ones now. */
+	g_atomic_int_set(&(plugin_data->queue_length),
+			 queue_count_unsafe(plugin_data));
+	request_unspill(plugin_data);
+}
+
+/*
+ * Put a parsed notification at the end of the queue of its urgency.
+ *
+ * The queue takes over the notification, it is freed if it can't be
+ * queued.
+ */
+ingest_status_t enqueue_notification_unsafe(kano_notifications_t *plugin_data,
+					    notification_info_t *data)
+{
+	deque_t *queue = &(plugin_data->queues[data->urgency]);
+	ingest_status_t status = INGEST_OK;
+
+	/* Don't queue world notifications in case they are
+	   being filtered. */
+	if (IS_TYPE(data, "world") &&
+	    !plugin_data->conf.allow_world_notifications) {
+		discard_notification_unsafe(plugin_data, data);
+		return INGEST_IGNORED;
+	}
+
+	if (is_duplicate_unsafe(plugin_data, data)) {
+		discard_notification_unsafe(plugin_data, data);
+		plugin_data->duplicates++;
+		g_debug("queue: dropped a duplicate (%" G_GUINT64_FORMAT
+			" so far)", plugin_data->duplicates);
+		return INGEST_IGNORED;
+	}
+
+	if (data->kind == NOTIFICATION_REGULAR && data->expires_at == 0 &&
+	    plugin_data->conf.default_ttl > 0)
+		data->expires_at = g_get_real_time() / G_USEC_PER_SEC +
+				   plugin_data->conf.default_ttl;
+
+	if (supersede_unsafe(plugin_data, data))
+		return INGEST_OK;
+
+	if (queue_count_unsafe(plugin_data) >= plugin_data->conf.max_queue_len &&
+	    handle_overflow_unsafe(plugin_data, data, &status))
+		return status;
+
+	data->queued_at = g_get_monotonic_time();
+
+	/* The reminder stays at the end of the queue. */
+	if (!is_last_element_reminder(plugin_data)) {
+		deque_push_tail(queue, data);
+		append_reminder_to_q(plugin_data);
+	} else if (data->urgency == URGENCY_LOW) {
+		deque_insert(queue, deque_length(queue) - 1, data);
+	} else {
+		deque_push_tail(queue, data);
+	}
+
+	plugin_data->queue_bytes += data->size;
+	journal_notification_unsafe(plugin_data, data);
+	index_notification_unsafe(plugin_data, data);
+
+	g_atomic_int_set(&(plugin_data->queue_length),
+			 queue_count_unsafe(plugin_data));
+
+	if (data->urgency == URGENCY_CRITICAL && !plugin_data->paused)
+		preempt_notification_unsafe(plugin_data);
+
+	g_debug("queue: %u notifications, %" G_GSIZE_FORMAT " bytes "
+		"(%" G_GSIZE_FORMAT " for the last one)",
+		g_atomic_int_get(&(plugin_data->queue_length)),
+		plugin_data->queue_bytes, data->size);
+
+	/* The new one might be folded in too. */
+	digest_unsafe(plugin_data);
+
+	return INGEST_OK;
+}
+
+static gboolean is_expired(notification_info_t *data, gint64 now)
+{
+	return data->expires_at > 0 && data->expires_at <= now;
+}
+
+/*
+ * Free a waiting notification that has been taken out of its queue
+ * because it's too late to show it.
+ */
+static void expire_notification_unsafe(kano_notifications_t *plugin_data,
+				       notification_info_t *data)
+{
+	plugin_data->queue_bytes -= data->size;
+	discard_notification_unsafe(plugin_data, data);
+	plugin_data->expired++;
+}
+
+/*
+ * The queues have got shorter, there might be room for some of the
+ * spilled notifications.
+ */
+static void queue_shrunk_unsafe(kano_notifications_t *plugin_data)
+{
+	g_atomic_int_set(&(plugin_data->queue_length),
+			 queue_count_unsafe(plugin_data));
+	request_unspill(plugin_data);
+}
+
+/*
+ * Pick the notification to be shown next and take it out of its queue.
+ * It still counts as queued until it's released.
+ *
+ * The queues are FIFO, so it's one of their heads. The most urgent one
+ * wins, low urgency notifications that have waited long enough count as
+ * normal ones and the older one goes first on a tie. Expired heads are
+ * dropped on the way.
+ *
+ * Returns NULL if nothing is waiting.
+ */
+notification_info_t *take_next_notification_unsafe(kano_notifications_t *plugin_data)
+{
+	notification_info_t *head, *next = NULL;
+	gint64 now = g_get_monotonic_time();
+	gint64 wall_now = g_get_real_time() / G_USEC_PER_SEC;
+	guint urgency, rank, next_rank = 0, next_urgency = 0;
+	guint expired = 0;
+	deque_t *queue;
+
+	for (urgency = 0; urgency < N_URGENCIES; urgency++) {
+		queue = &(plugin_data->queues[urgency]);
+
+		while ((head = deque_peek_head(queue)) != NULL &&
+		       is_expired(head, wall_now)) {
+			deque_pop_head(queue);
+			expire_notification_unsafe(plugin_data, head);
+			expired++;
+		}
+
+		if (!head)
+			continue;
+
+		rank = urgency;
+		if (rank < URGENCY_NORMAL &&
+		    head->kind == NOTIFICATION_REGULAR &&
+		    now - head->queued_at >= URGENCY_AGING_US)
+			rank = URGENCY_NORMAL;
+
+		if (!next || rank > next_rank ||
+		    (rank == next_rank && head->queued_at < next->queued_at)) {
+			next = head;
+			next_rank = rank;
+			next_urgency = urgency;
+		}
+	}
+
+	if (next) {
+		deque_pop_head(&(plugin_data->queues[next_urgency]));
+		forget_category_unsafe(plugin_data, next);
+
+		/* Anything queued from now on goes into a new digest. The
+		   tally is kept until then in case it's put back. */
+		if (next == plugin_data->digest.pending) {
+			plugin_data->digest.pending = NULL;
+			plugin_data->digest.shown = next;
+		}
+	}
+
+	if (expired > 0)
+		queue_shrunk_unsafe(plugin_data);
+
+	return next;
+}
+
+/*
+ * How long to show a notification for, in seconds.
+ *
+ * It's on_time, or the notification's own timeout, divided by the number
+ * of notifications waiting for each slot of the stack plus one. It
+ * doesn't go below min_on_time, unless that's more than the notification
+ * asked for, so a burst that hits that floor drains in linear time,
+ * min_on_time for each of them.
+ *
+ * Once the ones waiting would take more than DRAIN_BUDGET at min_on_time,
+ * the floor is scaled down to fit them into it. It goes back up as the
+ * queue gets shorter, so a long backlog drains in a time that only grows
+ * with the logarithm of its length, down to a second each. The digest
+ * keeps the number of them waiting in check as well.
+ */
+guint get_display_time_unsafe(kano_notifications_t *plugin_data,
+			      notification_info_t *notification)
+{
+	struct notification_conf *conf = &(plugin_data->conf);
+	guint base = notification->timeout > 0 ? notification->timeout :
+						 conf->on_time;
+	guint slots = conf->stack_size;
+	guint waiting = queue_waiting_unsafe(plugin_data);
+	guint shortest = MIN(conf->min_on_time, base);
+
+	if (waiting > 0)
+		shortest = MIN(shortest, MAX(DRAIN_BUDGET * slots / waiting, 1));
+
+	return CLAMP(base * slots / (waiting + slots), shortest, base);
+}
+
+/*
+ * Put a notification that was taken out to be shown back at the front of
+ * its queue, it's shown again later. It can be superseded again unless a
+ * newer one of its category is already waiting, and a digest takes in
+ * more notifications again unless a new one was started meanwhile.
+ */
+void requeue_notification_unsafe(kano_notifications_t *plugin_data,
+				 notification_info_t *notification)
+{
+	struct digest *digest = &(plugin_data->digest);
+
+	if (!notification)
+		return;
+
+	deque_insert(&(plugin_data->queues[notification->urgency]), 0,
+		     notification);
+	plugin_data->preempted++;
+
+	if (notification->kind == NOTIFICATION_REGULAR &&
+	    is_coalescible(plugin_data, notification) &&
+	    !g_hash_table_contains(plugin_data->categories,
+				   notification->category))
+		g_hash_table_insert(plugin_data->categories,
+				    notification->category, notification);
+
+	if (notification == digest->shown && !digest->pending) {
+		digest->pending = notification;
+		digest->shown = NULL;
+	}
+}
+
+/*
+ * Free a notification once it's been shown. There might be room for
+ * some of the spilled notifications afterwards.
+ */
+void release_notification_unsafe(kano_notifications_t *plugin_data,
+				 notification_info_t *notification)
+{
+	if (!notification)
+		return;
+
+	plugin_data->queue_bytes -= notification->size;
+	discard_notification_unsafe(plugin_data, notification);
+
+	queue_shrunk_unsafe(plugin_data);
+}
+
+/*
+ * Drop all the waiting notifications that have expired. The ones that
+ * are left keep their order.
+ *
+ * Returns how many there were.
+ */
+static guint expire_queued_unsafe(kano_notifications_t *plugin_data)
+{
+	gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+	notification_info_t *data;
+	deque_t *queue;
+	guint urgency, i, kept, expired = 0;
+
+	for (urgency = 0; urgency < N_URGENCIES; urgency++) {
+		queue = &(plugin_data->queues[urgency]);
+		kept = 0;
+
+		for (i = 0; i < deque_length(queue); i++) {
+			data = deque_nth(queue, i);
+
+			if (is_expired(data, now)) {
+				expire_notification_unsafe(plugin_data, data);
+				expired++;
+			} else {
+				deque_set_nth(queue, kept++, data);
+			}
+		}
+
+		deque_truncate(queue, kept);
+	}
+
+	if (expired > 0)
+		queue_shrunk_unsafe(plugin_data);
+
+	return expired;
+}
+
+static gboolean sweep_expired_cb(gpointer data)
+{
+	kano_notifications_t *plugin_data = (kano_notifications_t *)data;
+	guint expired;
+
+	g_mutex_lock(&(plugin_data->lock));
+
+	expired = expire_queued_unsafe(plugin_data);
+	if (expired > 0)
+		g_debug("queue: %u notifications expired (%" G_GUINT64_FORMAT
+			" so far)", expired, plugin_data->expired);
+
+	g_mutex_unlock(&(plugin_data->lock));
+
+	return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Start sweeping the queues for expired notifications. The sweep is
+ * coarse, most of them are dropped as they reach the front anyway.
+ */
+void init_expiry(kano_notifications_t *plugin_data)
+{
+	plugin_data->expired = 0;
+	plugin_data->expiry_sweep_id = g_timeout_add_seconds(
+		EXPIRY_SWEEP_INTERVAL, sweep_expired_cb, plugin_data);
+}
+
+void clear_expiry(kano_notifications_t *plugin_data)
+{
+	if (plugin_data->expiry_sweep_id > 0)
+		g_source_remove(plugin_data->expiry_sweep_id);
+	plugin_data->expiry_sweep_id = 0;
+}
+
+/*
+ * Parse the registration reminder. It's queued as is whenever it's due
+ * and never freed with the rest of the notifications.
+ */
+void init_reminder(kano_notifications_t *plugin_data)
+{
+	plugin_data->reminder = get_json_notification(REGISTER_REMINDER);
+	if (plugin_data->reminder) {
+		plugin_data->reminder->kind = NOTIFICATION_REMINDER;
+
+		/* It's queued as a low urgency one, anything that puts it
+		   back goes by this. */
+		plugin_data->reminder->urgency = URGENCY_LOW;
+	}
+}
+
+void clear_reminder(kano_notifications_t *plugin_data)
+{
+	g_free(plugin_data->reminder);
+	plugin_data->reminder = NULL;
+}
+
+/*
+ * The tally of the digest, it's needed before the journal is replayed.
+ */
+void init_digest(kano_notifications_t *plugin_data)
+{
+	struct digest *digest = &(plugin_data->digest);
+
+	digest->types = g_hash_table_new_full(g_str_hash, g_str_equal,
+					      g_free, NULL);
+	digest->latest = g_hash_table_new_full(g_str_hash, g_str_equal,
+					       g_free, g_free);
+	digest->journal = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+						NULL,
+						(GDestroyNotify) g_array_unref);
+}
+
+void clear_digest(kano_notifications_t *plugin_data)
+{
+	struct digest *digest = &(plugin_data->digest);
+
+	g_hash_table_destroy(digest->types);
+	g_hash_table_destroy(digest->latest);
+
+	/* Whatever is left is replayed from the journal next time. */
+	g_hash_table_destroy(digest->journal);
+	digest->types = NULL;
+	digest->latest = NULL;
+	digest->journal = NULL;
+	digest->pending = NULL;
+	digest->shown = NULL;
+}
+
+/*
+ * Put a notification recorded by a previous run back into the queue.
+ */
+static void replay_journal_entry(guint32 seq, const gchar *msg, gsize len,
+				 gpointer data)
+{
+	kano_notifications_t *plugin_data = (kano_notifications_t *)data;
+	notification_info_t *notification;
+	gchar *unparsed = g_strndup(msg, len);
+
+	notification = parse_saved_message(unparsed);
+	g_free(unparsed);
+
+	if (!notification) {
+		journal_complete(&(plugin_data->journal), seq);
+		return;
+	}
+
+	/* It's in the journal already. */
+	notification->journal_seq = seq;
+	enqueue_notification_unsafe(plugin_data, notification);
+}
+
+static gboolean sync_journal_cb(gpointer data)
+{
+	kano_notifications_t *plugin_data = (kano_notifications_t *)data;
+
+	g_mutex_lock(&(plugin_data->lock));
+	journal_sync(&(plugin_data->journal), FALSE);
+	g_mutex_unlock(&(plugin_data->lock));
+
+	return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Open the journal and restore the queue from it. This needs to run
+ * before any new notifications can arrive, so they are queued after the
+ * ones that were waiting already.
+ */
+void init_journal(kano_notifications_t *plugin_data)
+{
+	journal_t *journal = &(plugin_data->journal);
+	gchar *journal_filename = get_journal_filename();
+
+	journal->fd = -1;
+	journal->map = NULL;
+	journal->offsets = NULL;
+	plugin_data->journal_sync_id = 0;
+
+	if (!journal_filename)
+		return;
+
+	if (!journal_open(journal, journal_filename)) {
+		g_free(journal_filename);
+		return;
+	}
+	g_free(journal_filename);
+
+	g_mutex_lock(&(plugin_data->lock));
+
+	journal_replay(journal, replay_journal_entry, plugin_data);
+
+	if (queue_count_unsafe(plugin_data) > 0 && !plugin_data->paused)
+		g_idle_add((GSourceFunc) show_notification_window_from_q,
+			   plugin_data);
+
+	g_mutex_unlock(&(plugin_data->lock));
+
+	if (plugin_data->conf.journal_sync_interval > 0)
+		plugin_data->journal_sync_id = g_timeout_add_seconds(
+			plugin_data->conf.journal_sync_interval,
+			sync_journal_cb, plugin_data);
+}
+
+/*
+ * Close the journal. Whatever is still queued stays in it and will be
+ * shown after the next start.
+ */
+void clear_journal(kano_notifications_t *plugin_data)
+{
+	if (plugin_data->journal_sync_id > 0)
+		g_source_remove(plugin_data->journal_sync_id);
+	plugin_data->journal_sync_id = 0;
+
+	journal_close(&(plugin_data->journal));
+}
+
+/*
+ * Open the spill file. Anything that was left in it by the previous run
+ * is kept and read back like the rest.
+ */
+void init_spill(kano_notifications_t *plugin_data)
+{
+	struct spill *spill = &(plugin_data->spill);
+	struct stat st;
+
+	g_mutex_init(&(spill->lock));
+	g_queue_init(&(spill->outbox));
+	spill->read_offset = 0;
+	spill->write_offset = 0;
+	spill->spilled = 0;
+	spill->unspilled = 0;
+	spill->lost = 0;
+
+	gchar *spill_filename = get_spill_filename();
+	if (!spill_filename) {
+		spill->fd = -1;
+		return;
+	}
+
+	spill->fd = open(spill_filename, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+			 S_IRUSR | S_IWUSR);
+	g_free(spill_filename);
+
+	if (spill->fd < 0) {
+		perror("open");
+		return;
+	}
+
+	if (fstat(spill->fd, &st) == 0)
+		spill->write_offset = st.st_size;
+}
+
+void clear_spill(kano_notifications_t *plugin_data)
+{
+	struct spill *spill = &(plugin_data->spill);
+
+	/* The ingest thread is gone, write out what it didn't get to. */
+	flush_spill_cb(plugin_data);
+
+	if (spill->fd >= 0)
+		close(spill->fd);
+	spill->fd = -1;
+
+	g_mutex_clear(&(spill->lock));
+}
+
+/*
+ * Runs on the ingest thread. Read back as many spilled notifications as
+ * there is room for in the queue and hand them over to the GTK loop.
+ * Reading stops at the first one that's refused, it stays in the file.
+ * The ones that can't be parsed again are counted as lost.
+ */
+static gboolean unspill_cb(gpointer data)
+{
+	kano_notifications_t *plugin_data = (kano_notifications_t *)data;
+	struct spill *spill = &(plugin_data->spill);
+	notification_info_t *notification;
+	msgbuf_t buf;
+	msgbuf_result_t framing;
+	ingest_status_t status = INGEST_OK;
+	gchar *msg;
+	guint pending, room, handed_off = 0, lost = 0;
+	gsize offset, start;
+	gssize count;
+	int fd;
+
+	pending = g_atomic_int_get(&(plugin_data->queue_length)) +
+		  spsc_ring_count(&(plugin_data->handoff));
+	room = pending < plugin_data->conf.max_queue_len ?
+	       plugin_data->conf.max_queue_len - pending : 0;
+
+	/* Never more than the ring takes, or they would be spilled again.
+	   Only this thread pushes, so the room can only grow while they're
+	   read. */
+	room = MIN(room, plugin_data->handoff.mask + 1 -
+		   spsc_ring_count(&(plugin_data->handoff)));
+
+	/* Only this thread moves the offsets and touches the file, so the
+	   lock isn't held while it's read. Handing them over can take the
+	   plugin lock, which is taken before this one. */
+	g_mutex_lock(&(spill->lock));
+	offset = spill->read_offset;
+	if (offset >= spill->write_offset)
+		room = 0;
+	g_mutex_unlock(&(spill->lock));
+
+	if (room == 0)
+		return G_SOURCE_REMOVE;
+
+	gchar *spill_filename = get_spill_filename();
+	fd = spill_filename ? open(spill_filename, O_RDONLY | O_CLOEXEC) : -1;
+	g_free(spill_filename);
+
+	if (fd < 0 || lseek(fd, offset, SEEK_SET) < 0) {
+		perror("open");
+		if (fd >= 0)
+			close(fd);
+		return G_SOURCE_REMOVE;
+	}
+
+	msgbuf_init(&buf, plugin_data->conf.max_message_size +
+		    SAVED_MESSAGE_PREFIX_LEN);
+
+	/* From here on the offset is that of the end of the buffer. */
+	start = offset;
+
+	while (status != INGEST_QUEUE_FULL && handed_off < room &&
+	       (count = msgbuf_fill(&buf, fd)) > 0) {
+		offset += count;
+
+		while (handed_off < room) {
+			start = offset - (buf.end - buf.start);
+			framing = msgbuf_next(&buf, &msg, NULL);
+			if (framing == MSGBUF_NEED_MORE)
+				break;
+
+			notification = framing == MSGBUF_MESSAGE ?
+				       parse_saved_message(msg) : NULL;
+			if (!notification) {
+				lost++;
+				continue;
+			}
+
+			/* A refused one is read again the next time round. */
+			status = hand_off_notification(plugin_data, notification);
+			if (status == INGEST_QUEUE_FULL)
+				break;
+
+			if (status == INGEST_OK)
+				handed_off++;
+		}
+	}
+
+	/* Whatever is left in the buffer hasn't been read yet. */
+	if (status != INGEST_QUEUE_FULL)
+		start = offset - (buf.end - buf.start);
+
+	msgbuf_clear(&buf);
+	close(fd);
+
+	g_mutex_lock(&(spill->lock));
+
+	spill->read_offset = start;
+	spill->unspilled += handed_off;
+	spill->lost += lost;
+
+	/* Start over once everything has been read back. */
+	if (spill->read_offset >= spill->write_offset &&
+	    ftruncate(spill->fd, 0) == 0) {
+		spill->read_offset = 0;
+		spill->write_offset = 0;
+	}
+
+	g_mutex_unlock(&(spill->lock));
+
+	if (handed_off > 0)
+		wake_up_ui(plugin_data);
+
+	return G_SOURCE_REMOVE;
+}
+
+/*
+ * Ask the ingest thread to read back the spilled notifications if there
+ * are any.
+ */
+void request_unspill(kano_notifications_t *plugin_data)
+{
+	struct spill *spill = &(plugin_data->spill);
+	gboolean spilled;
+
+	g_mutex_lock(&(spill->lock));
+	spilled = spill->read_offset < spill->write_offset;
+	g_mutex_unlock(&(spill->lock));
+
+	if (spilled)
+		g_main_context_invoke(plugin_data->ingest_context, unspill_cb,
+				      plugin_data);
+}
@@ -0,0 +1,48 @@
+/*
+ * queue.h
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * The queue of notifications waiting to be displayed.
+ *
+ */
+
+#include <glib.h>
+
+#include "notifications.h"
+
+#ifndef notif_queue_h
+#define notif_queue_h
+
+ingest_status_t enqueue_notification_unsafe(kano_notifications_t *plugin_data,
+					    notification_info_t *data);
+gboolean is_coalescible(kano_notifications_t *plugin_data,
+			notification_info_t *data);
+notification_info_t *take_next_notification_unsafe(kano_notifications_t *plugin_data);
+guint get_display_time_unsafe(kano_notifications_t *plugin_data,
+			      notification_info_t *notification);
+void requeue_notification_unsafe(kano_notifications_t *plugin_data,
+				 notification_info_t *notification);
+void release_notification_unsafe(kano_notifications_t *plugin_data,
+				 notification_info_t *notification);
+
+void init_reminder(kano_notifications_t *plugin_data);
+void clear_reminder(kano_notifications_t *plugin_data);
+
+void init_digest(kano_notifications_t *plugin_data);
+void clear_digest(kano_notifications_t *plugin_data);
+
+void init_expiry(kano_notifications_t *plugin_data);
+void clear_expiry(kano_notifications_t *plugin_data);
+
+void init_journal(kano_notifications_t *plugin_data);
+void clear_journal(kano_notifications_t *plugin_data);
+
+void init_spill(kano_notifications_t *plugin_data);
+void clear_spill(kano_notifications_t *plugin_data);
+void request_unspill(kano_notifications_t *plugin_data);
+gboolean spill_notification(kano_notifications_t *plugin_data,
+			    notification_info_t *data);
+
+#endif
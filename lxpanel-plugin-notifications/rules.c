@@ -0,0 +1,358 @@
+/*
+ * rules.c
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * The titles of the awards are kept in the rule files of kano-profile,
+ * one for each category and subcategory. Normally they are compiled into
+ * an index by kano-rules-indexer when kano-profile is installed, which
+ * is mapped read only and searched directly, see rules_index.h.
+ *
+ * Without the index, or for awards that aren't in it, a rule file is
+ * only read and parsed when an award from it is first needed. After that
+ * its titles are kept in memory until kano-profile changes the file.
+ *
+ * The ids are parsed on the ingest thread, but the journal is replayed
+ * on the GTK main loop and the file monitors report to the loop that
+ * was current when they were created. So the cache is protected by its
+ * own lock.
+ *
+ */
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "parson/parson.h"
+#include "rules.h"
+#include "rules_index.h"
+
+
+static GMutex rules_lock;
+
+/* "category/subcategory" -> GHashTable of award -> title */
+static GHashTable *rules_titles = NULL;
+
+/* "category/subcategory" -> GFileMonitor, kept for as long as the daemon
+   runs, there are only so many rule files. */
+static GHashTable *rules_monitors = NULL;
+
+/* The compiled index, if there is one. */
+static struct {
+	guchar *map;
+	gsize size;
+
+	const rules_index_entry_t *entries;
+	guint32 count;
+	const gchar *strings;
+	guint32 strings_size;
+
+	GFileMonitor *monitor;
+	gboolean stale; /* it's been rebuilt since it was mapped */
+} rules_index;
+
+
+/*
+ * Map the index read only. The pages are shared with everything else
+ * that maps it and can be dropped by the kernel whenever it likes.
+ */
+static void open_rules_index(void)
+{
+	const rules_index_header_t *header;
+	struct stat st;
+	guchar *map;
+	int fd;
+
+	rules_index.map = NULL;
+	rules_index.stale = FALSE;
+
+	/* It's fine if it hasn't been built, the rule files are read
+	   directly then. */
+	fd = open(RULES_INDEX_PATH, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*header)) {
+		close(fd);
+		return;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return;
+	}
+
+	header = (const rules_index_header_t *)map;
+
+	/* The string table has to end with a NUL, so none of the
+	   searches can run past the end of the map. */
+	if (memcmp(header->magic, RULES_INDEX_MAGIC, RULES_INDEX_MAGIC_LEN) != 0 ||
+	    header->strings_offset < sizeof(*header) +
+	    (guint64)header->count * sizeof(rules_index_entry_t) ||
+	    (guint64)header->strings_offset + header->strings_size >
+	    (guint64)st.st_size ||
+	    header->strings_size == 0 ||
+	    map[header->strings_offset + header->strings_size - 1] != '\0') {
+		g_debug("rules: ignoring the broken index " RULES_INDEX_PATH);
+		munmap(map, st.st_size);
+		return;
+	}
+
+	rules_index.map = map;
+	rules_index.size = st.st_size;
+	rules_index.entries = (const rules_index_entry_t *)(header + 1);
+	rules_index.count = header->count;
+	rules_index.strings = (const gchar *)map + header->strings_offset;
+	rules_index.strings_size = header->strings_size;
+}
+
+static void close_rules_index(void)
+{
+	if (rules_index.map)
+		munmap(rules_index.map, rules_index.size);
+	rules_index.map = NULL;
+}
+
+/*
+ * The index is replaced by a new file when it's rebuilt, the old one
+ * stays mapped until the next lookup.
+ */
+static void rules_index_changed_cb(GFileMonitor *monitor, GFile *file,
+				   GFile *other_file, GFileMonitorEvent event,
+				   gpointer data)
+{
+	g_mutex_lock(&rules_lock);
+	rules_index.stale = TRUE;
+	g_mutex_unlock(&rules_lock);
+}
+
+/*
+ * Binary search the index for a "category/subcategory/award" key.
+ *
+ * Returns the title within the map or NULL if it's not in the index.
+ */
+static const gchar *lookup_rules_index(const gchar *key)
+{
+	const rules_index_entry_t *entry;
+	guint32 low = 0, high, middle;
+	gint cmp;
+
+	if (rules_index.stale) {
+		close_rules_index();
+		open_rules_index();
+	}
+
+	if (!rules_index.map)
+		return NULL;
+
+	high = rules_index.count;
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		entry = &(rules_index.entries[middle]);
+
+		if (entry->key >= rules_index.strings_size ||
+		    entry->title >= rules_index.strings_size)
+			return NULL;
+
+		cmp = strcmp(rules_index.strings + entry->key, key);
+		if (cmp == 0)
+			return rules_index.strings + entry->title;
+
+		if (cmp < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return NULL;
+}
+
+
+void init_rules_cache(void)
+{
+	GFile *file;
+
+	g_mutex_init(&rules_lock);
+
+	open_rules_index();
+
+	file = g_file_new_for_path(RULES_INDEX_PATH);
+	rules_index.monitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE,
+						  NULL, NULL);
+	g_object_unref(file);
+
+	if (rules_index.monitor)
+		g_signal_connect(rules_index.monitor, "changed",
+				 G_CALLBACK(rules_index_changed_cb), NULL);
+
+	rules_titles = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					     (GDestroyNotify)g_hash_table_destroy);
+	rules_monitors = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					       g_object_unref);
+}
+
+void clear_rules_cache(void)
+{
+	g_mutex_lock(&rules_lock);
+
+	g_hash_table_destroy(rules_titles);
+	rules_titles = NULL;
+
+	g_hash_table_destroy(rules_monitors);
+	rules_monitors = NULL;
+
+	if (rules_index.monitor)
+		g_object_unref(rules_index.monitor);
+	rules_index.monitor = NULL;
+	close_rules_index();
+
+	g_mutex_unlock(&rules_lock);
+	g_mutex_clear(&rules_lock);
+}
+
+/*
+ * Drop the titles of a rule file that has been changed or removed, it's
+ * read again the next time it's needed.
+ */
+static void rules_changed_cb(GFileMonitor *monitor, GFile *file,
+			     GFile *other_file, GFileMonitorEvent event,
+			     gpointer data)
+{
+	const gchar *key = (const gchar *)data;
+
+	g_mutex_lock(&rules_lock);
+
+	if (rules_titles)
+		g_hash_table_remove(rules_titles, key);
+
+	g_mutex_unlock(&rules_lock);
+}
+
+/*
+ * Watch a rule file for changes, unless it's watched already. The key
+ * is used as the identifier of the file in the cache.
+ */
+static void watch_rules_file(const gchar *key, const gchar *path)
+{
+	GFileMonitor *monitor;
+	GFile *file;
+	gchar *monitor_key;
+
+	if (g_hash_table_contains(rules_monitors, key))
+		return;
+
+	file = g_file_new_for_path(path);
+	monitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE, NULL, NULL);
+	g_object_unref(file);
+
+	if (!monitor)
+		return;
+
+	/* The key in the table lives as long as the monitor itself. */
+	monitor_key = g_strdup(key);
+	g_hash_table_insert(rules_monitors, monitor_key, monitor);
+	g_signal_connect(monitor, "changed", G_CALLBACK(rules_changed_cb),
+			 monitor_key);
+}
+
+/*
+ * Read all the titles from a rule file.
+ *
+ * Returns NULL if the file can't be read.
+ */
+static GHashTable *load_rules_file(const gchar *path)
+{
+	JSON_Value *root_value = NULL;
+	JSON_Object *root = NULL;
+	JSON_Object *award = NULL;
+	GHashTable *titles;
+	const gchar *title;
+	gsize i, count;
+
+	root_value = json_parse_file(path);
+	if (json_value_get_type(root_value) != JSONObject) {
+		json_value_free(root_value);
+		return NULL;
+	}
+
+	titles = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	root = json_value_get_object(root_value);
+	count = json_object_get_count(root);
+	for (i = 0; i < count; i++) {
+		award = json_value_get_object(json_object_get_value_at(root, i));
+		title = json_object_get_string(award, "title");
+		if (title)
+			g_hash_table_insert(titles,
+					    g_strdup(json_object_get_name(root, i)),
+					    g_strdup(title));
+	}
+
+	json_value_free(root_value);
+	return titles;
+}
+
+/*
+ * Look up the title of an award in the rules of its category and
+ * subcategory, e.g. badges, application and feedbacker.
+ *
+ * Returns a newly allocated string or NULL if there's no such award.
+ */
+gchar *lookup_award_title(const gchar *category, const gchar *subcategory,
+			  const gchar *award)
+{
+	GHashTable *titles;
+	gchar *key, *path, *title = NULL;
+	gchar index_key[RULES_INDEX_MAX_KEY];
+	const gchar *indexed;
+
+	g_mutex_lock(&rules_lock);
+
+	if (g_snprintf(index_key, sizeof(index_key), "%s/%s/%s",
+		       category, subcategory, award) < (gint)sizeof(index_key)) {
+		indexed = lookup_rules_index(index_key);
+		if (indexed) {
+			title = g_strdup(indexed);
+			g_mutex_unlock(&rules_lock);
+			return title;
+		}
+	}
+
+	key = g_strdup_printf("%s/%s", category, subcategory);
+
+	titles = g_hash_table_lookup(rules_titles, key);
+	if (!titles) {
+		path = g_strdup_printf(RULES_BASE_PATH, category, subcategory);
+
+		/* Files that can't be read aren't cached, so whatever
+		   the ids say, the cache only grows as far as the number
+		   of rule files. */
+		titles = load_rules_file(path);
+		if (titles) {
+			g_hash_table_insert(rules_titles, g_strdup(key), titles);
+			watch_rules_file(key, path);
+		}
+
+		g_free(path);
+	}
+
+	if (titles)
+		title = g_strdup(g_hash_table_lookup(titles, award));
+
+	g_mutex_unlock(&rules_lock);
+
+	g_free(key);
+	return title;
+}
@@ -0,0 +1,26 @@
+/*
+ * rules.h
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * Access to the kano-profile rule files which describe the awards.
+ *
+ */
+
+#include <glib.h>
+
+#ifndef notif_rules_h
+#define notif_rules_h
+
+#include "rules_index.h"
+
+#define RULES_BASE_PATH RULES_DIR "/%s/%s.json"
+
+void init_rules_cache(void);
+void clear_rules_cache(void);
+
+gchar *lookup_award_title(const gchar *category, const gchar *subcategory,
+			  const gchar *award);
+
+#endif
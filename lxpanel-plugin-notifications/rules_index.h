@@ -0,0 +1,46 @@
+/*
+ * rules_index.h
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * The layout of the award index written by kano-rules-indexer.
+ *
+ * The index is compiled from the kano-profile rule files when they are
+ * installed or updated, so the daemon doesn't have to parse them. It
+ * consists of the header, the entries sorted by their keys and a table
+ * of NUL terminated strings the entries point into. Each key has the
+ * form "category/subcategory/award".
+ *
+ * Everything is stored in the byte order of the machine that built it,
+ * the index is never shared between machines.
+ *
+ */
+
+#include <glib.h>
+
+#ifndef notif_rules_index_h
+#define notif_rules_index_h
+
+#define RULES_DIR "/usr/share/kano-profile/rules"
+#define RULES_INDEX_PATH "/var/cache/kano-notifications/rules.idx"
+
+#define RULES_INDEX_MAGIC "KNR1"
+#define RULES_INDEX_MAGIC_LEN 4
+
+/* Longer keys can't be looked up. */
+#define RULES_INDEX_MAX_KEY 256
+
+typedef struct {
+	gchar magic[RULES_INDEX_MAGIC_LEN];
+	guint32 count;		/* number of entries */
+	guint32 strings_offset;	/* from the start of the file */
+	guint32 strings_size;
+} rules_index_header_t;
+
+typedef struct {
+	guint32 key;	/* offsets into the string table */
+	guint32 title;
+} rules_index_entry_t;
+
+#endif
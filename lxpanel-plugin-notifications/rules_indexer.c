@@ -0,0 +1,218 @@
+/*
+ * rules_indexer.c
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * Compile the kano-profile rule files into the index that is used by
+ * kano-notifications-daemon to look up the titles of the awards. See
+ * rules_index.h for the format.
+ *
+ * Usage: kano-rules-indexer [rules-dir [index-file]]
+ *
+ */
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "parson/parson.h"
+#include "rules_index.h"
+
+
+typedef struct {
+	gchar *key;
+	gchar *title;
+} award_t;
+
+static gint compare_awards(gconstpointer a, gconstpointer b)
+{
+	return strcmp(((const award_t *)a)->key, ((const award_t *)b)->key);
+}
+
+/*
+ * Add the title of every award in a rule file to the list.
+ */
+static void index_rules_file(GArray *awards, const gchar *path,
+			     const gchar *category, const gchar *subcategory)
+{
+	JSON_Value *root_value = NULL;
+	JSON_Object *root = NULL;
+	JSON_Object *award_object = NULL;
+	const gchar *title;
+	award_t award;
+	gsize i, count;
+
+	root_value = json_parse_file(path);
+	if (json_value_get_type(root_value) != JSONObject) {
+		fprintf(stderr, "Skipping %s, it's not a JSON object\n", path);
+		json_value_free(root_value);
+		return;
+	}
+
+	root = json_value_get_object(root_value);
+	count = json_object_get_count(root);
+	for (i = 0; i < count; i++) {
+		award_object = json_value_get_object(json_object_get_value_at(root, i));
+		title = json_object_get_string(award_object, "title");
+		if (!title)
+			continue;
+
+		award.key = g_strdup_printf("%s/%s/%s", category, subcategory,
+					    json_object_get_name(root, i));
+		award.title = g_strdup(title);
+
+		if (strlen(award.key) >= RULES_INDEX_MAX_KEY) {
+			fprintf(stderr, "Skipping %s, the key is too long\n",
+				award.key);
+			g_free(award.key);
+			g_free(award.title);
+			continue;
+		}
+
+		g_array_append_val(awards, award);
+	}
+
+	json_value_free(root_value);
+}
+
+/*
+ * Collect the awards from all the <category>/<subcategory>.json files.
+ */
+static gboolean index_rules_dir(GArray *awards, const gchar *rules_dir)
+{
+	GDir *dir, *category_dir;
+	const gchar *category, *filename;
+	gchar *category_path, *path, *subcategory;
+
+	dir = g_dir_open(rules_dir, 0, NULL);
+	if (!dir) {
+		fprintf(stderr, "Can't open %s\n", rules_dir);
+		return FALSE;
+	}
+
+	while ((category = g_dir_read_name(dir))) {
+		category_path = g_build_filename(rules_dir, category, NULL);
+		category_dir = g_dir_open(category_path, 0, NULL);
+
+		while (category_dir &&
+		       (filename = g_dir_read_name(category_dir))) {
+			if (!g_str_has_suffix(filename, ".json"))
+				continue;
+
+			subcategory = g_strndup(filename,
+						strlen(filename) - strlen(".json"));
+			path = g_build_filename(category_path, filename, NULL);
+
+			index_rules_file(awards, path, category, subcategory);
+
+			g_free(path);
+			g_free(subcategory);
+		}
+
+		if (category_dir)
+			g_dir_close(category_dir);
+		g_free(category_path);
+	}
+
+	g_dir_close(dir);
+	return TRUE;
+}
+
+/*
+ * Write the sorted awards out as an index. It's written next to the
+ * destination first and moved into place, so the daemon never maps a
+ * half written file.
+ */
+static gboolean write_index(GArray *awards, const gchar *index_path)
+{
+	rules_index_header_t header;
+	rules_index_entry_t entry;
+	GString *strings = g_string_new(NULL);
+	GArray *entries = g_array_new(FALSE, FALSE, sizeof(rules_index_entry_t));
+	gchar *tmp_path = g_strconcat(index_path, ".tmp", NULL);
+	gchar *dirname = g_path_get_dirname(index_path);
+	gboolean ok = FALSE;
+	award_t *award;
+	FILE *out;
+	guint i;
+
+	for (i = 0; i < awards->len; i++) {
+		award = &g_array_index(awards, award_t, i);
+
+		entry.key = strings->len;
+		g_string_append_len(strings, award->key, strlen(award->key) + 1);
+		entry.title = strings->len;
+		g_string_append_len(strings, award->title, strlen(award->title) + 1);
+
+		g_array_append_val(entries, entry);
+	}
+
+	memcpy(header.magic, RULES_INDEX_MAGIC, RULES_INDEX_MAGIC_LEN);
+	header.count = entries->len;
+	header.strings_offset = sizeof(header) +
+		entries->len * sizeof(rules_index_entry_t);
+	header.strings_size = strings->len;
+
+	g_mkdir_with_parents(dirname, 0755);
+
+	out = fopen(tmp_path, "wb");
+	if (!out) {
+		perror("fopen");
+	} else {
+		ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+		     fwrite(entries->data, sizeof(rules_index_entry_t),
+			    entries->len, out) == entries->len &&
+		     fwrite(strings->str, 1, strings->len, out) == strings->len;
+
+		ok = fflush(out) == 0 && fsync(fileno(out)) == 0 && ok;
+		ok = fclose(out) == 0 && ok;
+
+		if (ok && rename(tmp_path, index_path) < 0) {
+			perror("rename");
+			ok = FALSE;
+		}
+
+		if (!ok)
+			unlink(tmp_path);
+	}
+
+	g_free(dirname);
+	g_free(tmp_path);
+	g_array_free(entries, TRUE);
+	g_string_free(strings, TRUE);
+
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	const gchar *rules_dir = argc > 1 ? argv[1] : RULES_DIR;
+	const gchar *index_path = argc > 2 ? argv[2] : RULES_INDEX_PATH;
+	GArray *awards = g_array_new(FALSE, FALSE, sizeof(award_t));
+	award_t *award;
+	gboolean ok;
+	guint i;
+
+	ok = index_rules_dir(awards, rules_dir);
+	if (ok) {
+		g_array_sort(awards, compare_awards);
+		ok = write_index(awards, index_path);
+	}
+
+	if (ok)
+		printf("Indexed %u awards into %s\n", awards->len, index_path);
+
+	for (i = 0; i < awards->len; i++) {
+		award = &g_array_index(awards, award_t, i);
+		g_free(award->key);
+		g_free(award->title);
+	}
+	g_array_free(awards, TRUE);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,243 @@
+/*
+ * server.c
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * The socket accepts the same messages as the pipe, one per line. Each
+ * connection is read independently, so a producer can keep it open and
+ * send as many notifications as it likes. Sending "ack" makes the daemon
+ * reply to every subsequent message with one of "ok", "ignored",
+ * "queue-full" or "invalid".
+ *
+ * At most SERVER_MAX_CLIENTS producers can be connected at once, the
+ * connections past that are closed right after they're accepted.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "notifications.h"
+#include "server.h"
+#include "ingest.h"
+
+
+static void close_client(server_client_t *client)
+{
+	kano_notifications_t *plugin_data = client->plugin_data;
+
+	plugin_data->clients = g_list_remove(plugin_data->clients, client);
+	plugin_data->n_clients--;
+
+	ingest_remove_watch(client->watch);
+	g_io_channel_unref(client->channel);
+	close(client->src.fd);
+	msgbuf_clear(&(client->src.buf));
+	g_free(client);
+}
+
+/*
+ * Read whatever the producer sent. The connection is closed once the
+ * other end hangs up.
+ */
+static gboolean client_watch_cb(GIOChannel *source, GIOCondition cond,
+				gpointer data)
+{
+	server_client_t *client = (server_client_t *)data;
+	gssize status;
+
+	status = ingest_source(client->plugin_data, &(client->src));
+	if (status == 0 || (status < 0 && errno != EAGAIN) ||
+	    (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL))) {
+		close_client(client);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean server_watch_cb(GIOChannel *source, GIOCondition cond,
+				gpointer data);
+
+static void watch_server(kano_notifications_t *plugin_data)
+{
+	plugin_data->server_watch = ingest_add_watch(plugin_data,
+						     plugin_data->server_channel,
+						     G_IO_IN,
+						     (GIOFunc)server_watch_cb,
+						     (gpointer)plugin_data);
+}
+
+static gboolean retry_accept_cb(gpointer data)
+{
+	kano_notifications_t *plugin_data = (kano_notifications_t *)data;
+
+	g_source_unref(plugin_data->server_retry);
+	plugin_data->server_retry = NULL;
+	watch_server(plugin_data);
+
+	return G_SOURCE_REMOVE;
+}
+
+/*
+ * The connection stays pending when there are no file descriptors left
+ * to accept it with, so the watch would fire over and over. Stop
+ * watching for a while instead.
+ */
+static void back_off_accept(kano_notifications_t *plugin_data)
+{
+	ingest_remove_watch(plugin_data->server_watch);
+	plugin_data->server_watch = NULL;
+
+	plugin_data->server_retry = g_timeout_source_new(SERVER_ACCEPT_RETRY_DELAY);
+	g_source_set_callback(plugin_data->server_retry, retry_accept_cb,
+			      plugin_data, NULL);
+	g_source_attach(plugin_data->server_retry,
+			plugin_data->ingest_context);
+}
+
+/*
+ * Accept all the pending connections and start watching each of them.
+ */
+static gboolean server_watch_cb(GIOChannel *source, GIOCondition cond,
+				gpointer data)
+{
+	kano_notifications_t *plugin_data = (kano_notifications_t *)data;
+	server_client_t *client;
+	int fd;
+
+	while ((fd = accept4(plugin_data->server_fd, NULL, NULL,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		if (plugin_data->n_clients >= SERVER_MAX_CLIENTS) {
+			close(fd);
+			continue;
+		}
+
+		client = g_new0(server_client_t, 1);
+		client->plugin_data = plugin_data;
+		client->src.fd = fd;
+		client->src.reply_fd = fd;
+		client->src.ack = FALSE;
+		msgbuf_init(&(client->src.buf),
+			    plugin_data->conf.max_message_size);
+
+		client->channel = g_io_channel_unix_new(fd);
+		client->watch = ingest_add_watch(plugin_data, client->channel,
+						 G_IO_IN | G_IO_HUP | G_IO_ERR,
+						 (GIOFunc)client_watch_cb,
+						 (gpointer)client);
+
+		plugin_data->clients = g_list_prepend(plugin_data->clients,
+						      client);
+		plugin_data->n_clients++;
+	}
+
+	if (errno != EAGAIN && errno != EINTR)
+		perror("accept");
+
+	if (errno == EMFILE || errno == ENFILE) {
+		back_off_accept(plugin_data);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Create the socket in the user's $HOME and start accepting connections.
+ * The connections are handled on the ingest thread.
+ */
+gboolean start_server(kano_notifications_t *plugin_data)
+{
+	struct sockaddr_un addr;
+	gchar *socket_filename = get_socket_filename();
+
+	plugin_data->server_fd = -1;
+	plugin_data->server_watch = NULL;
+	plugin_data->server_retry = NULL;
+	plugin_data->clients = NULL;
+	plugin_data->n_clients = 0;
+
+	if (!socket_filename)
+		return FALSE;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (g_strlcpy(addr.sun_path, socket_filename, sizeof(addr.sun_path)) >=
+	    sizeof(addr.sun_path)) {
+		g_free(socket_filename);
+		return FALSE;
+	}
+
+	/* remove previous instance of the socket */
+	unlink(socket_filename);
+
+	plugin_data->server_fd = socket(AF_UNIX,
+					SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+					0);
+	if (plugin_data->server_fd < 0) {
+		perror("socket");
+		g_free(socket_filename);
+		return FALSE;
+	}
+
+	if (bind(plugin_data->server_fd, (struct sockaddr *)&addr,
+		 sizeof(addr)) < 0 ||
+	    listen(plugin_data->server_fd, SERVER_BACKLOG) < 0) {
+		perror("bind");
+		close(plugin_data->server_fd);
+		plugin_data->server_fd = -1;
+		g_free(socket_filename);
+		return FALSE;
+	}
+
+	/* Same as the pipe, anyone can send notifications. */
+	chmod(socket_filename, 0666);
+	g_free(socket_filename);
+
+	plugin_data->server_channel = g_io_channel_unix_new(plugin_data->server_fd);
+	watch_server(plugin_data);
+
+	return TRUE;
+}
+
+/*
+ * Disconnect all the producers and remove the socket.
+ */
+void stop_server(kano_notifications_t *plugin_data)
+{
+	if (plugin_data->server_fd < 0)
+		return;
+
+	while (plugin_data->clients)
+		close_client(plugin_data->clients->data);
+
+	if (plugin_data->server_watch)
+		ingest_remove_watch(plugin_data->server_watch);
+	if (plugin_data->server_retry) {
+		g_source_destroy(plugin_data->server_retry);
+		g_source_unref(plugin_data->server_retry);
+	}
+	g_io_channel_unref(plugin_data->server_channel);
+	close(plugin_data->server_fd);
+	plugin_data->server_fd = -1;
+
+	gchar *socket_filename = get_socket_filename();
+	if (socket_filename) {
+		unlink(socket_filename);
+		g_free(socket_filename);
+	}
+}
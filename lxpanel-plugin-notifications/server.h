@@ -0,0 +1,40 @@
+/*
+ * server.h
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * The unix socket that producers can keep connected to the daemon.
+ *
+ */
+
+#include <glib.h>
+
+#include "notifications.h"
+
+#ifndef notif_server_h
+#define notif_server_h
+
+#define SERVER_BACKLOG 16
+
+/* Each connection has a buffer of up to max_message_size, so this bounds
+   the memory they take up together. More are turned away. */
+#define SERVER_MAX_CLIENTS 32
+
+/* How long to stop accepting for when out of file descriptors, in ms. */
+#define SERVER_ACCEPT_RETRY_DELAY 1000
+
+/*
+ * A single producer connected to the socket.
+ */
+typedef struct {
+	ingest_source_t src;
+	GIOChannel *channel;
+	GSource *watch;
+	kano_notifications_t *plugin_data;
+} server_client_t;
+
+gboolean start_server(kano_notifications_t *plugin_data);
+void stop_server(kano_notifications_t *plugin_data);
+
+#endif
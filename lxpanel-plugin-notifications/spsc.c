@@ -0,0 +1,89 @@
+/*
+ * spsc.c
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * The g_atomic_int_*() accessors act as full memory barriers, which
+ * makes the slot written before the tail is published visible to the
+ * consumer and the other way around for the head.
+ *
+ */
+
+#include <glib.h>
+
+#include "spsc.h"
+
+
+void spsc_ring_init(spsc_ring_t *ring, guint capacity)
+{
+	guint size = 1;
+
+	while (size < capacity)
+		size <<= 1;
+
+	ring->slots = g_new0(gpointer, size);
+	ring->mask = size - 1;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+void spsc_ring_clear(spsc_ring_t *ring)
+{
+	g_free(ring->slots);
+	ring->slots = NULL;
+	ring->mask = 0;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+/*
+ * The number of items in the ring. It's only a snapshot when called
+ * from either of the threads, but never more than what's really there
+ * from the consumer's point of view and never less from the producer's.
+ */
+guint spsc_ring_count(spsc_ring_t *ring)
+{
+	return (guint)g_atomic_int_get(&(ring->tail)) -
+	       (guint)g_atomic_int_get(&(ring->head));
+}
+
+/*
+ * Add an item to the ring. Must only be called from the producer.
+ *
+ * Returns FALSE if the ring is full.
+ */
+gboolean spsc_ring_push(spsc_ring_t *ring, gpointer item)
+{
+	guint tail = (guint)ring->tail;
+	guint head = (guint)g_atomic_int_get(&(ring->head));
+
+	if (tail - head > ring->mask)
+		return FALSE;
+
+	ring->slots[tail & ring->mask] = item;
+	g_atomic_int_set(&(ring->tail), (gint)(tail + 1));
+
+	return TRUE;
+}
+
+/*
+ * Take the oldest item out of the ring. Must only be called from the
+ * consumer.
+ *
+ * Returns NULL if the ring is empty.
+ */
+gpointer spsc_ring_pop(spsc_ring_t *ring)
+{
+	guint head = (guint)ring->head;
+	guint tail = (guint)g_atomic_int_get(&(ring->tail));
+	gpointer item;
+
+	if (head == tail)
+		return NULL;
+
+	item = ring->slots[head & ring->mask];
+	g_atomic_int_set(&(ring->head), (gint)(head + 1));
+
+	return item;
+}
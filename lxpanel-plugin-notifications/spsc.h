@@ -0,0 +1,34 @@
+/*
+ * spsc.h
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * A lock-free ring of pointers for passing data from exactly one
+ * producer thread to exactly one consumer thread.
+ *
+ */
+
+#include <glib.h>
+
+#ifndef notif_spsc_h
+#define notif_spsc_h
+
+typedef struct {
+	gpointer *slots;
+	guint mask;		/* capacity - 1, the capacity is a power of 2 */
+
+	/* Both counters only ever grow and wrap around naturally. The
+	   head is only written by the consumer, the tail by the producer. */
+	volatile gint head;
+	volatile gint tail;
+} spsc_ring_t;
+
+void spsc_ring_init(spsc_ring_t *ring, guint capacity);
+void spsc_ring_clear(spsc_ring_t *ring);
+
+guint spsc_ring_count(spsc_ring_t *ring);
+gboolean spsc_ring_push(spsc_ring_t *ring, gpointer item);
+gpointer spsc_ring_pop(spsc_ring_t *ring);
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ * test_deque.c
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * Tests for the ring of slots the queues are kept in. The random runs
+ * are checked against a plain array doing the same.
+ *
+ */
+
+#include <glib.h>
+
+#include "../deque.h"
+
+#define N_STEPS 20000
+
+
+static void assert_same(deque_t *deque, GPtrArray *model)
+{
+	guint i;
+
+	g_assert_cmpuint(deque_length(deque), ==, model->len);
+
+	for (i = 0; i < model->len; i++)
+		g_assert(deque_nth(deque, i) == g_ptr_array_index(model, i));
+
+	g_assert(deque_peek_head(deque) ==
+		 (model->len ? g_ptr_array_index(model, 0) : NULL));
+	g_assert(deque_peek_tail(deque) ==
+		 (model->len ? g_ptr_array_index(model, model->len - 1) : NULL));
+}
+
+static void test_deque_basics(void)
+{
+	deque_t deque;
+
+	deque_init(&deque, 2);
+
+	g_assert(deque_pop_head(&deque) == NULL);
+	g_assert(deque_remove(&deque, 0) == NULL);
+
+	deque_push_tail(&deque, GUINT_TO_POINTER(2));
+	deque_push_tail(&deque, GUINT_TO_POINTER(3));
+	deque_insert(&deque, 0, GUINT_TO_POINTER(1));
+
+	/* Past the end goes to the end. */
+	deque_insert(&deque, 10, GUINT_TO_POINTER(4));
+
+	g_assert_cmpuint(deque_length(&deque), ==, 4);
+	g_assert_cmpuint(GPOINTER_TO_UINT(deque_remove(&deque, 2)), ==, 3);
+	g_assert_cmpuint(GPOINTER_TO_UINT(deque_pop_head(&deque)), ==, 1);
+	g_assert_cmpuint(GPOINTER_TO_UINT(deque_pop_head(&deque)), ==, 2);
+	g_assert_cmpuint(GPOINTER_TO_UINT(deque_pop_head(&deque)), ==, 4);
+	g_assert_cmpuint(deque_length(&deque), ==, 0);
+
+	deque_clear(&deque);
+}
+
+static void test_deque_random(void)
+{
+	deque_t deque;
+	GPtrArray *model = g_ptr_array_new();
+	gpointer item, expected;
+	guint step, index;
+
+	/* Small to begin with, so it has to grow with the head anywhere. */
+	deque_init(&deque, 1);
+
+	for (step = 1; step <= N_STEPS; step++) {
+		item = GUINT_TO_POINTER(step);
+		index = g_test_rand_int_range(0, model->len + 1);
+
+		switch (g_test_rand_int_range(0, 5)) {
+		case 0:
+			deque_push_tail(&deque, item);
+			g_ptr_array_add(model, item);
+			break;
+		case 1:
+			deque_insert(&deque, index, item);
+			g_ptr_array_insert(model, index, item);
+			break;
+		case 2:
+			expected = model->len ?
+				   g_ptr_array_remove_index(model, 0) : NULL;
+			g_assert(deque_pop_head(&deque) == expected);
+			break;
+		case 3:
+			expected = index < model->len ?
+				   g_ptr_array_remove_index(model, index) : NULL;
+			g_assert(deque_remove(&deque, index) == expected);
+			break;
+		default:
+			if (index < model->len) {
+				deque_set_nth(&deque, index, item);
+				g_ptr_array_index(model, index) = item;
+			}
+			break;
+		}
+
+		assert_same(&deque, model);
+	}
+
+	deque_truncate(&deque, model->len / 2);
+	g_ptr_array_set_size(model, model->len / 2);
+	assert_same(&deque, model);
+
+	g_ptr_array_free(model, TRUE);
+	deque_clear(&deque);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/deque/basics", test_deque_basics);
+	g_test_add_func("/deque/random", test_deque_random);
+
+	return g_test_run();
+}
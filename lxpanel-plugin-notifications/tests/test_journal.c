@@ -0,0 +1,216 @@
+/*
+ * test_journal.c
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * Tests for the journal of queued notifications, mostly what is replayed
+ * after it's opened again.
+ *
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <string.h>
+
+#include "../journal.h"
+
+typedef struct {
+	gchar *dir;
+	gchar *path;
+	journal_t journal;
+} fixture_t;
+
+
+static void setup(fixture_t *fixture, gconstpointer data)
+{
+	fixture->dir = g_dir_make_tmp("test-journal-XXXXXX", NULL);
+	g_assert(fixture->dir != NULL);
+
+	fixture->path = g_build_filename(fixture->dir, "journal", NULL);
+	g_assert(journal_open(&(fixture->journal), fixture->path));
+}
+
+static void teardown(fixture_t *fixture, gconstpointer data)
+{
+	journal_close(&(fixture->journal));
+	g_unlink(fixture->path);
+	g_rmdir(fixture->dir);
+	g_free(fixture->path);
+	g_free(fixture->dir);
+}
+
+static void reopen(fixture_t *fixture)
+{
+	journal_close(&(fixture->journal));
+	g_assert(journal_open(&(fixture->journal), fixture->path));
+}
+
+static void collect(guint32 seq, const gchar *msg, gsize len, gpointer data)
+{
+	g_ptr_array_add((GPtrArray *)data, g_strndup(msg, len));
+}
+
+/*
+ * Replay the journal and check the messages against the NULL terminated
+ * list that follows.
+ */
+static void assert_replay(fixture_t *fixture, ...)
+{
+	GPtrArray *replayed = g_ptr_array_new_with_free_func(g_free);
+	const gchar *expected;
+	va_list args;
+	guint i = 0;
+
+	journal_replay(&(fixture->journal), collect, replayed);
+
+	va_start(args, fixture);
+	while ((expected = va_arg(args, const gchar *)) != NULL) {
+		g_assert_cmpuint(i, <, replayed->len);
+		g_assert_cmpstr(g_ptr_array_index(replayed, i), ==, expected);
+		i++;
+	}
+	va_end(args);
+
+	g_assert_cmpuint(i, ==, replayed->len);
+	g_ptr_array_free(replayed, TRUE);
+}
+
+static void test_journal_replay(fixture_t *fixture, gconstpointer data)
+{
+	guint32 first, second, third;
+
+	first = journal_append(&(fixture->journal), "first", 5);
+	second = journal_append(&(fixture->journal), "second", 6);
+	third = journal_append(&(fixture->journal), "third", 5);
+
+	g_assert_cmpuint(first, !=, 0);
+	g_assert_cmpuint(second, >, first);
+	g_assert_cmpuint(third, >, second);
+
+	journal_complete(&(fixture->journal), second);
+	assert_replay(fixture, "first", "third", NULL);
+
+	/* The sequence numbers carry on where they were. */
+	reopen(fixture);
+	assert_replay(fixture, "first", "third", NULL);
+	g_assert_cmpuint(journal_append(&(fixture->journal), "fourth", 6), >,
+			 third);
+
+	journal_complete(&(fixture->journal), first);
+	reopen(fixture);
+	assert_replay(fixture, "third", "fourth", NULL);
+
+	/* Unknown ones are ignored. */
+	journal_complete(&(fixture->journal), 0);
+	journal_complete(&(fixture->journal), first);
+	assert_replay(fixture, "third", "fourth", NULL);
+}
+
+static void complete_all(guint32 seq, const gchar *msg, gsize len,
+			 gpointer data)
+{
+	journal_complete((journal_t *)data, seq);
+}
+
+static void test_journal_complete_in_replay(fixture_t *fixture,
+					    gconstpointer data)
+{
+	journal_append(&(fixture->journal), "one", 3);
+	journal_append(&(fixture->journal), "two", 3);
+
+	journal_replay(&(fixture->journal), complete_all, &(fixture->journal));
+	assert_replay(fixture, NULL);
+
+	reopen(fixture);
+	assert_replay(fixture, NULL);
+}
+
+static void collect_prefix(guint32 seq, const gchar *msg, gsize len,
+			   gpointer data)
+{
+	g_assert_cmpuint(len, ==, 1024);
+	g_ptr_array_add((GPtrArray *)data, g_strndup(msg, 3));
+}
+
+static void test_journal_compact(fixture_t *fixture, gconstpointer data)
+{
+	GPtrArray *replayed = g_ptr_array_new_with_free_func(g_free);
+	gchar msg[1024], prefix[4];
+	guint32 seqs[64];
+	guint i;
+
+	/* Well past the initial size, so it grows as well. */
+	for (i = 0; i < G_N_ELEMENTS(seqs); i++) {
+		memset(msg, 'a' + i % 26, sizeof(msg));
+		g_snprintf(prefix, sizeof(prefix), "%03u", i);
+		memcpy(msg, prefix, 3);
+		seqs[i] = journal_append(&(fixture->journal), msg, sizeof(msg));
+		g_assert_cmpuint(seqs[i], !=, 0);
+	}
+
+	g_assert_cmpuint(fixture->journal.size, >, JOURNAL_INITIAL_SIZE);
+
+	/* Completing all but the last few has it compacted on the way,
+	   which moves the live ones. */
+	for (i = 0; i < G_N_ELEMENTS(seqs) - 3; i++)
+		journal_complete(&(fixture->journal), seqs[i]);
+
+	g_assert_cmpuint(fixture->journal.used, <, sizeof(msg) * 32);
+
+	reopen(fixture);
+	journal_replay(&(fixture->journal), collect_prefix, replayed);
+
+	g_assert_cmpuint(replayed->len, ==, 3);
+	g_assert_cmpstr(g_ptr_array_index(replayed, 0), ==, "061");
+	g_assert_cmpstr(g_ptr_array_index(replayed, 1), ==, "062");
+	g_assert_cmpstr(g_ptr_array_index(replayed, 2), ==, "063");
+	g_ptr_array_free(replayed, TRUE);
+
+	/* The moved ones can still be completed. */
+	for (i = G_N_ELEMENTS(seqs) - 3; i < G_N_ELEMENTS(seqs); i++)
+		journal_complete(&(fixture->journal), seqs[i]);
+	journal_append(&(fixture->journal), "last", 4);
+
+	reopen(fixture);
+	assert_replay(fixture, "last", NULL);
+}
+
+static void test_journal_torn_tail(fixture_t *fixture, gconstpointer data)
+{
+	guint32 seq;
+	gsize offset;
+
+	journal_append(&(fixture->journal), "kept", 4);
+	seq = journal_append(&(fixture->journal), "torn", 4);
+
+	/* An entry whose state was never written marks the end. */
+	offset = GPOINTER_TO_SIZE(g_hash_table_lookup(fixture->journal.offsets,
+						      GUINT_TO_POINTER(seq)));
+	memset(fixture->journal.map + offset + sizeof(guint32), 0,
+	       sizeof(guint32));
+
+	reopen(fixture);
+	assert_replay(fixture, "kept", NULL);
+
+	journal_append(&(fixture->journal), "after", 5);
+	reopen(fixture);
+	assert_replay(fixture, "kept", "after", NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add("/journal/replay", fixture_t, NULL, setup,
+		   test_journal_replay, teardown);
+	g_test_add("/journal/complete-in-replay", fixture_t, NULL, setup,
+		   test_journal_complete_in_replay, teardown);
+	g_test_add("/journal/compact", fixture_t, NULL, setup,
+		   test_journal_compact, teardown);
+	g_test_add("/journal/torn-tail", fixture_t, NULL, setup,
+		   test_journal_torn_tail, teardown);
+
+	return g_test_run();
+}
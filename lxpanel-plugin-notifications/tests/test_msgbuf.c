@@ -0,0 +1,196 @@
+/*
+ * test_msgbuf.c
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * Tests for the framing of the messages read from the pipe, the socket
+ * and the spill file. The data is fed through a pipe in pieces to check
+ * that nothing depends on how it's split up by the reads.
+ *
+ */
+
+#include <glib.h>
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../msgbuf.h"
+
+#define MAX_MESSAGE 16
+
+typedef struct {
+	int fds[2];
+	msgbuf_t buf;
+} fixture_t;
+
+
+static void setup(fixture_t *fixture, gconstpointer data)
+{
+	g_assert_cmpint(pipe(fixture->fds), ==, 0);
+	g_assert_cmpint(fcntl(fixture->fds[0], F_SETFL, O_NONBLOCK), ==, 0);
+	msgbuf_init(&(fixture->buf), MAX_MESSAGE);
+}
+
+static void teardown(fixture_t *fixture, gconstpointer data)
+{
+	msgbuf_clear(&(fixture->buf));
+	close(fixture->fds[0]);
+	close(fixture->fds[1]);
+}
+
+/*
+ * Write the data to the pipe and read all of it into the buffer.
+ */
+static void feed(fixture_t *fixture, const void *data, gsize len)
+{
+	g_assert_cmpint(write(fixture->fds[1], data, len), ==, len);
+	g_assert_cmpint(msgbuf_fill(&(fixture->buf), fixture->fds[0]), ==, len);
+}
+
+static void feed_frame(fixture_t *fixture, const gchar *payload, gsize len)
+{
+	guchar header[MSGBUF_MAX_HEADER_LEN];
+
+	feed(fixture, header, msgbuf_frame_header(header, len));
+	feed(fixture, payload, len);
+}
+
+static void assert_message(fixture_t *fixture, const gchar *expected)
+{
+	gchar *msg;
+	gsize len;
+
+	g_assert_cmpint(msgbuf_next(&(fixture->buf), &msg, &len), ==,
+			MSGBUF_MESSAGE);
+	g_assert_cmpstr(msg, ==, expected);
+	g_assert_cmpuint(len, ==, strlen(expected));
+}
+
+static void assert_next(fixture_t *fixture, msgbuf_result_t expected)
+{
+	gchar *msg;
+
+	g_assert_cmpint(msgbuf_next(&(fixture->buf), &msg, NULL), ==, expected);
+}
+
+static void test_msgbuf_lines(fixture_t *fixture, gconstpointer data)
+{
+	assert_next(fixture, MSGBUF_NEED_MORE);
+
+	feed(fixture, "hel", 3);
+	assert_next(fixture, MSGBUF_NEED_MORE);
+
+	feed(fixture, "lo\nworld\n\npart", 14);
+	assert_message(fixture, "hello");
+	assert_message(fixture, "world");
+	assert_message(fixture, "");
+	assert_next(fixture, MSGBUF_NEED_MORE);
+
+	feed(fixture, "ial\n", 4);
+	assert_message(fixture, "partial");
+	assert_next(fixture, MSGBUF_NEED_MORE);
+
+	/* The pipe has been drained. */
+	g_assert_cmpint(msgbuf_fill(&(fixture->buf), fixture->fds[0]), ==, -1);
+}
+
+static void test_msgbuf_frames(fixture_t *fixture, gconstpointer data)
+{
+	guchar header[MSGBUF_MAX_HEADER_LEN];
+
+	/* A frame can hold newlines and is followed straight away by the
+	   next message, whose first byte is put back after use. */
+	feed_frame(fixture, "a\nb", 3);
+	feed(fixture, "line\n", 5);
+	feed_frame(fixture, "x", 1);
+	feed_frame(fixture, "yz", 2);
+
+	assert_message(fixture, "a\nb");
+	assert_message(fixture, "line");
+	assert_message(fixture, "x");
+	assert_message(fixture, "yz");
+	assert_next(fixture, MSGBUF_NEED_MORE);
+
+	/* The header can arrive before the payload. */
+	feed(fixture, header, msgbuf_frame_header(header, 5));
+	assert_next(fixture, MSGBUF_NEED_MORE);
+	feed(fixture, "ab", 2);
+	assert_next(fixture, MSGBUF_NEED_MORE);
+	feed(fixture, "cde", 3);
+	assert_message(fixture, "abcde");
+}
+
+static void test_msgbuf_frame_header(void)
+{
+	guchar header[MSGBUF_MAX_HEADER_LEN];
+
+	g_assert_cmpuint(msgbuf_frame_header(header, 0), ==, 2);
+	g_assert_cmpuint(header[0], ==, MSGBUF_FRAME_MAGIC);
+	g_assert_cmpuint(header[1], ==, 0);
+
+	g_assert_cmpuint(msgbuf_frame_header(header, 300), ==, 3);
+	g_assert_cmpuint(header[1], ==, 0xac);
+	g_assert_cmpuint(header[2], ==, 0x02);
+}
+
+static void test_msgbuf_oversize(fixture_t *fixture, gconstpointer data)
+{
+	gchar frame[MAX_MESSAGE * 2];
+
+	/* Dropped as soon as the newline turns up. */
+	feed(fixture, "0123456789abcdefXYZ\nok\n", 23);
+	assert_next(fixture, MSGBUF_OVERSIZE);
+	assert_message(fixture, "ok");
+
+	/* Dropped before the end arrives, the rest is skipped. */
+	feed(fixture, "0123456789abcdefXYZ", 19);
+	assert_next(fixture, MSGBUF_OVERSIZE);
+	assert_next(fixture, MSGBUF_NEED_MORE);
+	feed(fixture, "still too long\nafter\n", 21);
+	assert_message(fixture, "after");
+
+	/* A frame is skipped by its length, newlines and all. */
+	memset(frame, '\n', sizeof(frame));
+	feed_frame(fixture, frame, sizeof(frame));
+	feed(fixture, "next\n", 5);
+	assert_next(fixture, MSGBUF_OVERSIZE);
+	assert_message(fixture, "next");
+
+	g_assert_cmpuint(fixture->buf.oversize, ==, 3);
+}
+
+static void test_msgbuf_bad_frames(fixture_t *fixture, gconstpointer data)
+{
+	static const guchar endless[] = {
+		MSGBUF_FRAME_MAGIC, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80
+	};
+
+	feed_frame(fixture, "a\0b", 3);
+	feed(fixture, "next\n", 5);
+	assert_next(fixture, MSGBUF_BAD_FRAME);
+	assert_message(fixture, "next");
+
+	/* A length that never ends only costs the header. */
+	feed(fixture, endless, sizeof(endless));
+	feed(fixture, "\x01z\n", 3);
+	assert_next(fixture, MSGBUF_BAD_FRAME);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add("/msgbuf/lines", fixture_t, NULL, setup, test_msgbuf_lines,
+		   teardown);
+	g_test_add("/msgbuf/frames", fixture_t, NULL, setup, test_msgbuf_frames,
+		   teardown);
+	g_test_add_func("/msgbuf/frame-header", test_msgbuf_frame_header);
+	g_test_add("/msgbuf/oversize", fixture_t, NULL, setup,
+		   test_msgbuf_oversize, teardown);
+	g_test_add("/msgbuf/bad-frames", fixture_t, NULL, setup,
+		   test_msgbuf_bad_frames, teardown);
+
+	return g_test_run();
+}
@@ -0,0 +1,250 @@
+/*
+ * test_parse.c
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * Tests for the hashed lookup tables of the JSON fields and the control
+ * commands, and for the saved form of the messages that the journal and
+ * the spill file keep.
+ *
+ * The tables are private to their files, so those are built into the
+ * test itself and the daemon's main() is renamed out of the way.
+ *
+ */
+
+#define main kano_notifications_main
+#include "../kano_notifications.c"
+#undef main
+
+#include "../control.c"
+
+#include <glib/gstdio.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+
+static void test_json_fields(void)
+{
+	static const gchar *unknown[] = {
+		"", "t", "titles", "Title", "button3_label", "button1_labels",
+	};
+	json_field_t field;
+	guint i, used = 0;
+
+	for (field = 0; field < N_JSON_FIELDS; field++)
+		g_assert_cmpint(lookup_json_field(json_fields[field].key), ==,
+				field);
+
+	/* Every field has a slot of its own. */
+	for (i = 0; i < JSON_FIELD_HASH_SIZE; i++)
+		if (json_field_slots[i] != JSON_FIELD_NONE)
+			used++;
+	g_assert_cmpuint(used, ==, N_JSON_FIELDS);
+
+	for (i = 0; i < G_N_ELEMENTS(unknown); i++)
+		g_assert_cmpint(lookup_json_field(unknown[i]), ==,
+				JSON_FIELD_NONE);
+}
+
+static void test_control_commands(void)
+{
+	const gchar *name;
+	guint i, used = 0;
+
+	for (i = 0; i < G_N_ELEMENTS(control_commands); i++) {
+		name = control_commands[i].name;
+		g_assert(lookup_control_command(name, strlen(name)) ==
+			 &(control_commands[i]));
+		g_assert_cmpint(is_legacy_command(name, strlen(name)), ==,
+				control_commands[i].legacy);
+	}
+
+	for (i = 0; i < CONTROL_HASH_SIZE; i++)
+		if (control_slots[i] != 0)
+			used++;
+	g_assert_cmpuint(used, ==, G_N_ELEMENTS(control_commands));
+
+	/* Only the first len characters count. */
+	g_assert(lookup_control_command("stats extra", 5) != NULL);
+	g_assert(lookup_control_command("stat", 4) == NULL);
+	g_assert(lookup_control_command("statss", 6) == NULL);
+	g_assert(lookup_control_command("", 0) == NULL);
+}
+
+static void test_classify(void)
+{
+	g_assert_cmpint(classify_message("!stats"), ==, MESSAGE_CONTROL);
+	g_assert_cmpint(classify_message("pause"), ==, MESSAGE_CONTROL);
+	g_assert_cmpint(classify_message("stats"), ==, MESSAGE_UNKNOWN);
+	g_assert_cmpint(classify_message("level:5"), ==, MESSAGE_ID);
+	g_assert_cmpint(classify_message(" {\"title\": \"a\"}"), ==,
+			MESSAGE_JSON);
+	g_assert_cmpint(classify_message("hello"), ==, MESSAGE_UNKNOWN);
+}
+
+static void test_expiry(void)
+{
+	notification_info_t *data;
+	gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+
+	data = get_json_notification("{\"title\": \"a\", \"byline\": \"b\", "
+				     "\"ttl\": 600}");
+	g_assert(data != NULL);
+	g_assert_cmpint(data->ttl, ==, 600);
+	g_assert_cmpint(data->expires_at, >=, now + 600);
+	g_assert_cmpint(data->expires_at, <=, now + 601);
+	free_notification(data);
+
+	/* An explicit time wins over the ttl. */
+	data = get_json_notification("{\"title\": \"a\", \"byline\": \"b\", "
+				     "\"ttl\": 600, \"expires_at\": 1000}");
+	g_assert(data != NULL);
+	g_assert_cmpint(data->ttl, ==, 0);
+	g_assert_cmpint(data->expires_at, ==, 1000);
+	free_notification(data);
+}
+
+static void test_saved_message(void)
+{
+	static const gchar *json =
+		"{\"title\": \"Hello\", \"byline\": \"there\", \"urgency\": 2, "
+		"\"category\": \"level\", \"expires_at\": 2000000000}";
+	notification_info_t *data, *saved;
+	gchar *msg;
+
+	data = get_json_notification(json);
+	g_assert(data != NULL);
+
+	msg = save_message(data);
+	g_assert_cmpuint(strlen(msg), <=,
+			 strlen(json) + SAVED_MESSAGE_PREFIX_LEN);
+
+	saved = parse_saved_message(msg);
+	g_assert(saved != NULL);
+	g_assert_cmpstr(saved->title, ==, "Hello");
+	g_assert_cmpstr(saved->byline, ==, "there");
+	g_assert_cmpstr(saved->category, ==, "level");
+	g_assert_cmpint(saved->urgency, ==, 2);
+	g_assert_cmpint(saved->expires_at, ==, 2000000000);
+	g_assert_cmpuint(saved->fingerprint, ==, data->fingerprint);
+
+	free_notification(saved);
+	g_free(msg);
+
+	/* One that was let off the default ttl stays that way. */
+	data->expires_at = 0;
+	msg = save_message(data);
+	saved = parse_saved_message(msg);
+	g_assert(saved != NULL);
+	g_assert_cmpint(saved->expires_at, ==, EXPIRES_NEVER);
+
+	free_notification(saved);
+	free_notification(data);
+	g_free(msg);
+
+	msg = g_strdup("@x {\"title\": \"a\", \"byline\": \"b\"}");
+	g_assert(parse_saved_message(msg) == NULL);
+	g_free(msg);
+}
+
+/*
+ * Append a record to the file the way write_spill() does.
+ */
+static void spill_message(int fd, const gchar *msg)
+{
+	guchar header[MSGBUF_MAX_HEADER_LEN];
+	gsize len = strlen(msg);
+
+	g_assert_cmpint(write(fd, header, msgbuf_frame_header(header, len)), >,
+			0);
+	g_assert_cmpint(write(fd, msg, len), ==, len);
+}
+
+static void test_spill_records(void)
+{
+	notification_info_t *first, *second, *data;
+	gchar *dir, *path, *saved, *msg;
+	GPtrArray *read_back = g_ptr_array_new();
+	msgbuf_t buf;
+	msgbuf_result_t framing;
+	guint unparsable = 0;
+	int fd;
+
+	dir = g_dir_make_tmp("test-spill-XXXXXX", NULL);
+	g_assert(dir != NULL);
+	path = g_build_filename(dir, "spill", NULL);
+
+	fd = open(path, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+	g_assert_cmpint(fd, >=, 0);
+
+	first = get_json_notification("{\"title\": \"one\", \"byline\": "
+				      "\"line\\nbreak\", \"ttl\": 60}");
+	second = get_json_notification("{\"title\": \"two\", \"byline\": \"b\"}");
+
+	saved = save_message(first);
+	spill_message(fd, saved);
+	g_free(saved);
+
+	spill_message(fd, "@1 not a notification");
+
+	saved = save_message(second);
+	spill_message(fd, saved);
+	g_free(saved);
+
+	/* Read back the way unspill_cb() does, the bad one is skipped. */
+	g_assert_cmpint(lseek(fd, 0, SEEK_SET), ==, 0);
+	msgbuf_init(&buf, DEFAULT_MAX_MESSAGE_SIZE + SAVED_MESSAGE_PREFIX_LEN);
+
+	while (msgbuf_fill(&buf, fd) > 0) {
+		while ((framing = msgbuf_next(&buf, &msg, NULL)) !=
+		       MSGBUF_NEED_MORE) {
+			g_assert_cmpint(framing, ==, MSGBUF_MESSAGE);
+
+			data = parse_saved_message(msg);
+			if (data)
+				g_ptr_array_add(read_back, data);
+			else
+				unparsable++;
+		}
+	}
+
+	g_assert_cmpuint(unparsable, ==, 1);
+	g_assert_cmpuint(read_back->len, ==, 2);
+
+	data = g_ptr_array_index(read_back, 0);
+	g_assert_cmpstr(data->title, ==, "one");
+	g_assert_cmpstr(data->byline, ==, "line\nbreak");
+	g_assert_cmpint(data->expires_at, ==, first->expires_at);
+
+	data = g_ptr_array_index(read_back, 1);
+	g_assert_cmpstr(data->title, ==, "two");
+	g_assert_cmpint(data->expires_at, ==, EXPIRES_NEVER);
+
+	g_ptr_array_foreach(read_back, (GFunc) free_notification, NULL);
+	g_ptr_array_free(read_back, TRUE);
+	free_notification(first);
+	free_notification(second);
+	msgbuf_clear(&buf);
+
+	close(fd);
+	g_unlink(path);
+	g_rmdir(dir);
+	g_free(path);
+	g_free(dir);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/parse/json-fields", test_json_fields);
+	g_test_add_func("/parse/control-commands", test_control_commands);
+	g_test_add_func("/parse/classify", test_classify);
+	g_test_add_func("/parse/expiry", test_expiry);
+	g_test_add_func("/parse/saved-message", test_saved_message);
+	g_test_add_func("/parse/spill-records", test_spill_records);
+
+	return g_test_run();
+}
@@ -0,0 +1,114 @@
+/*
+ * test_spsc.c
+ *
+ * Copyright (C) 2019 Kano Computing Ltd.
+ * License: http://www.gnu.org/licenses/gpl-2.0.txt GNU GPL v2
+ *
+ * Tests for the hand-off ring between the ingest thread and the GTK loop.
+ *
+ */
+
+#include <glib.h>
+
+#include "../spsc.h"
+
+#define N_ITEMS 1000000
+
+
+static void test_spsc_capacity(void)
+{
+	spsc_ring_t ring;
+	guint i;
+
+	/* The capacity is rounded up to a power of 2. */
+	spsc_ring_init(&ring, 5);
+	g_assert_cmpuint(ring.mask, ==, 7);
+
+	for (i = 1; i <= 8; i++)
+		g_assert(spsc_ring_push(&ring, GUINT_TO_POINTER(i)));
+
+	g_assert(!spsc_ring_push(&ring, GUINT_TO_POINTER(9)));
+	g_assert_cmpuint(spsc_ring_count(&ring), ==, 8);
+
+	for (i = 1; i <= 8; i++)
+		g_assert_cmpuint(GPOINTER_TO_UINT(spsc_ring_pop(&ring)), ==, i);
+
+	g_assert(spsc_ring_pop(&ring) == NULL);
+	g_assert_cmpuint(spsc_ring_count(&ring), ==, 0);
+
+	spsc_ring_clear(&ring);
+}
+
+static void test_spsc_wrap_around(void)
+{
+	spsc_ring_t ring;
+	guint i, next = 1, expected = 1;
+
+	spsc_ring_init(&ring, 4);
+
+	/* Keep it partly full so the slots are reused many times over. */
+	for (i = 0; i < 1000; i++) {
+		while (spsc_ring_push(&ring, GUINT_TO_POINTER(next)))
+			next++;
+
+		g_assert_cmpuint(spsc_ring_count(&ring), ==, 4);
+
+		g_assert_cmpuint(GPOINTER_TO_UINT(spsc_ring_pop(&ring)), ==,
+				 expected++);
+		g_assert_cmpuint(GPOINTER_TO_UINT(spsc_ring_pop(&ring)), ==,
+				 expected++);
+	}
+
+	spsc_ring_clear(&ring);
+}
+
+static gpointer produce(gpointer data)
+{
+	spsc_ring_t *ring = (spsc_ring_t *)data;
+	guint i;
+
+	for (i = 1; i <= N_ITEMS; i++)
+		while (!spsc_ring_push(ring, GUINT_TO_POINTER(i)))
+			g_thread_yield();
+
+	return NULL;
+}
+
+static void test_spsc_threads(void)
+{
+	spsc_ring_t ring;
+	GThread *producer;
+	gpointer item;
+	guint expected = 1;
+
+	spsc_ring_init(&ring, 64);
+	producer = g_thread_new("producer", produce, &ring);
+
+	/* Everything arrives exactly once and in order. */
+	while (expected <= N_ITEMS) {
+		item = spsc_ring_pop(&ring);
+		if (!item) {
+			g_thread_yield();
+			continue;
+		}
+
+		g_assert_cmpuint(GPOINTER_TO_UINT(item), ==, expected);
+		expected++;
+	}
+
+	g_thread_join(producer);
+	g_assert(spsc_ring_pop(&ring) == NULL);
+
+	spsc_ring_clear(&ring);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/spsc/capacity", test_spsc_capacity);
+	g_test_add_func("/spsc/wrap-around", test_spsc_wrap_around);
+	g_test_add_func("/spsc/threads", test_spsc_threads);
+
+	return g_test_run();
+}
@@ -20,12 +20,15 @@
 #include "ui.h"
 #include "notifications.h"
 #include "config.h"
+#include "queue.h"
 
 #define LED_START_CMD "sudo -b kano-speakerleds notification start"
 #define LED_STOP_CMD "sudo kano-speakerleds notification stop"
 
+#define WINDOW_SPACING 10 /* between the stacked windows */
 
-static void close_notification_unsafe(kano_notifications_t *plugin_data);
+
+static void close_slot_unsafe(notification_slot_t *slot);
 
 /*
  * Non-blocking way of launching a command.
@@ -57,20 +60,31 @@ void launch_cmd(const char *cmd, gboolean hourglass)
 }
 
 
+/*
+ * Stop the timer that would close the window.
+ */
+static void remove_window_timeout(notification_slot_t *slot)
+{
+	if (slot->window_timeout > 0) {
+		GSource *source_no;
+		source_no = g_main_context_find_source_by_id(NULL, slot->window_timeout);
+		if (source_no) {
+			g_source_destroy(source_no);
+		}
+	}
+	slot->window_timeout = 0;
+}
+
 /*
  * Destroy the notification and show the next one in the queue.
  */
-static void hide_notification_window(kano_notifications_t *plugin_data)
+static void hide_notification_window(notification_slot_t *slot)
 {
+	kano_notifications_t *plugin_data = slot->plugin_data;
+
 	if (g_mutex_trylock(&(plugin_data->lock)) == TRUE) {
-		if (plugin_data->window_timeout > 0) {
-			GSource *source_no;
-			source_no = g_main_context_find_source_by_id(NULL, plugin_data->window_timeout);
-			if (source_no) {
-				g_source_destroy(source_no);
-			}
-		}
-		close_notification_unsafe(plugin_data);
+		remove_window_timeout(slot);
+		close_slot_unsafe(slot);
 		g_mutex_unlock(&(plugin_data->lock));
 	}
 }
@@ -103,7 +117,7 @@ static gboolean eventbox_click_cb(GtkWidget *w, GdkEventButton *event,
 	/* Launch the application pointed to by the "command"
 	   notification field */
 	launch_cmd(user_data->notification->command, TRUE);
-	hide_notification_window(user_data->plugin_data);
+	hide_notification_window(user_data->slot);
 	g_free(user_data);
 
 	/* Notification tracking is done after processing the visual work,
@@ -121,9 +135,9 @@ static gboolean eventbox_click_cb(GtkWidget *w, GdkEventButton *event,
  * A callback for when the user clicks on the closing button.
  */
 static gboolean close_button_click_cb(GtkWidget *w, GdkEventButton *event,
-				      kano_notifications_t *plugin_data)
+				      notification_slot_t *slot)
 {
-	hide_notification_window(plugin_data);
+	hide_notification_window(slot);
 	return TRUE;
 }
 
@@ -171,7 +185,7 @@ static void set_hover_callbacks(GtkWidget *w, gchar *default_bg,
 /* Creates the closing X button widget for the bottom right corner of
  * the notification window.
  */
-static GtkWidget *construct_x_button_widget(kano_notifications_t *plugin_data)
+static GtkWidget *construct_x_button_widget(notification_slot_t *slot)
 {
 	GdkColor button_bg;
 	gdk_color_parse(BUTTON_COLOUR, &button_bg);
@@ -186,7 +200,7 @@ static GtkWidget *construct_x_button_widget(kano_notifications_t *plugin_data)
 	set_hover_callbacks(x_button, BUTTON_COLOUR, BUTTON_HIGHLIGHTED_COLOUR);
 
 	gtk_signal_connect(GTK_OBJECT(x_button), "button-release-event",
-		     GTK_SIGNAL_FUNC(close_button_click_cb), plugin_data);
+		     GTK_SIGNAL_FUNC(close_button_click_cb), slot);
 
 	return x_button;
 }
@@ -197,7 +211,7 @@ static gboolean launch_button_cb(GtkWidget *w, GdkEventButton *event,
 	if (user_data->command)
 		launch_cmd(user_data->command, TRUE);
 
-	hide_notification_window(user_data->plugin_data);
+	hide_notification_window(user_data->slot);
 	g_free(user_data);
 
 	return TRUE;
@@ -206,7 +220,7 @@ static gboolean launch_button_cb(GtkWidget *w, GdkEventButton *event,
 
 static GtkWidget *construct_extra_button(gchar *label, gchar *colour,
 					 gchar *hover, gchar *command,
-					 kano_notifications_t *plugin_data)
+					 notification_slot_t *slot)
 {
 	GdkColor button_bg, label_colour;
 	GtkWidget *button = gtk_event_box_new();
@@ -246,7 +260,7 @@ static GtkWidget *construct_extra_button(gchar *label, gchar *colour,
 
 	gtk_user_data_t *user_data = g_new0(gtk_user_data_t, 1);
 	user_data->notification = NULL;
-	user_data->plugin_data = plugin_data;
+	user_data->slot = slot;
 	user_data->command = command;
 
 	gtk_signal_connect(GTK_OBJECT(button), "button-release-event",
@@ -255,7 +269,7 @@ static GtkWidget *construct_extra_button(gchar *label, gchar *colour,
 	return button;
 }
 
-static GtkWidget *construct_extra_buttons(kano_notifications_t *plugin_data,
+static GtkWidget *construct_extra_buttons(notification_slot_t *slot,
 					  notification_info_t *n)
 {
 	GtkWidget *buttons = gtk_vbox_new(FALSE, 0);
@@ -263,43 +277,123 @@ static GtkWidget *construct_extra_buttons(kano_notifications_t *plugin_data,
 	if (n->button1_label) {
 		GtkWidget *button1 = construct_extra_button(n->button1_label,
 					n->button1_colour, n->button1_hover,
-					n->button1_command, plugin_data);
+					n->button1_command, slot);
 		gtk_box_pack_start(GTK_BOX(buttons), button1, TRUE, TRUE, 0);
 	}
 
 	if (n->button2_label) {
 		GtkWidget *button2 = construct_extra_button(n->button2_label,
 					n->button2_colour, n->button2_hover,
-					n->button2_command, plugin_data);
+					n->button2_command, slot);
 		gtk_box_pack_start(GTK_BOX(buttons), button2, TRUE, TRUE, 0);
 	}
 
 	return buttons;
 }
 
+/*
+ * Lay the windows out on top of each other above the panel, the oldest
+ * one at the bottom. Needs to be done whenever one comes or goes.
+ */
+static void reflow_stack(kano_notifications_t *plugin_data)
+{
+	notification_slot_t *order[MAX_STACK_SIZE];
+	notification_slot_t *slot;
+	GdkWindow *gdk_win;
+	int offset = 0, win_pos_x, win_pos_y;
+	guint i, j, n = 0;
+
+	/* Sort them by age, there's only a handful of them. */
+	for (i = 0; i < MAX_STACK_SIZE; i++) {
+		slot = &(plugin_data->slots[i]);
+		if (slot->window == NULL)
+			continue;
+
+		for (j = n; j > 0 && order[j - 1]->shown > slot->shown; j--)
+			order[j] = order[j - 1];
+		order[j] = slot;
+		n++;
+	}
+
+	/* TODO Positioning doesn't take into account the position of the
+	   panel itself. */
+	for (i = 0; i < n; i++) {
+		gdk_win = gtk_widget_get_window(GTK_WIDGET(order[i]->window));
+		win_pos_x = (gdk_screen_width() - gdk_window_get_width(gdk_win))/2;
+		win_pos_y = gdk_screen_height() - gdk_window_get_height(gdk_win) -
+			    plugin_data->panel_height - WINDOW_MARGIN_BOTTOM -
+			    offset;
+		gtk_window_move(GTK_WINDOW(order[i]->window), win_pos_x, win_pos_y);
+
+		offset += gdk_window_get_height(gdk_win) + WINDOW_SPACING;
+	}
+}
+
+/*
+ * Returns a slot with no notification in it, or NULL if as many are
+ * shown as the stack_size allows.
+ */
+static notification_slot_t *find_free_slot(kano_notifications_t *plugin_data)
+{
+	guint i, size = MIN(plugin_data->conf.stack_size, MAX_STACK_SIZE);
+
+	for (i = 0; i < size; i++)
+		if (plugin_data->slots[i].notification == NULL)
+			return &(plugin_data->slots[i]);
+
+	return NULL;
+}
+
+static gboolean is_showing(kano_notifications_t *plugin_data)
+{
+	guint i;
+
+	for (i = 0; i < MAX_STACK_SIZE; i++)
+		if (plugin_data->slots[i].window != NULL)
+			return TRUE;
+
+	return FALSE;
+}
+
+static gboolean slot_timeout_cb(notification_slot_t *slot)
+{
+	kano_notifications_t *plugin_data = slot->plugin_data;
+
+	g_mutex_lock(&(plugin_data->lock));
+	slot->window_timeout = 0;
+	close_slot_unsafe(slot);
+	g_mutex_unlock(&(plugin_data->lock));
+
+	return G_SOURCE_REMOVE;
+}
+
 /*
  * Constructs the notification window and display's it.
  *
  * This function also sets up a timer that will destroy the window after
- * a set period of time. It's expected that no notification is being
- * shown at the time of this function call.
+ * a set period of time. It's expected that the slot is free at the time
+ * of this function call.
  */
-void show_notification_window(kano_notifications_t *plugin_data,
+void show_notification_window(notification_slot_t *slot,
 				     notification_info_t *notification)
 {
-	GtkWidget *win = gtk_window_new(GTK_WINDOW_POPUP);
+	kano_notifications_t *plugin_data = slot->plugin_data;
+	GtkWidget *win;
 
 	if (notification == NULL)
 		return;
 
-	plugin_data->window = win;
+	win = gtk_window_new(GTK_WINDOW_POPUP);
+	slot->notification = notification;
+	slot->window = win;
+	slot->shown = ++plugin_data->shown_count;
 
 	GtkStyle *style;
 	GtkWidget *eventbox = gtk_event_box_new();
 
 	gtk_user_data_t *user_data = g_new0(gtk_user_data_t, 1);
 	user_data->notification = notification;
-	user_data->plugin_data = plugin_data;
+	user_data->slot = slot;
 	user_data->command = NULL;
 
 	if (notification->command && strlen(notification->command) > 0) {
@@ -403,10 +497,9 @@ void show_notification_window(kano_notifications_t *plugin_data,
 	GtkWidget *buttons_widget;
 	if (IS_TYPE(notification, "small") &&
 	    (notification->button1_label || notification->button2_label)) {
-		buttons_widget = construct_extra_buttons(plugin_data,
-							 notification);
+		buttons_widget = construct_extra_buttons(slot, notification);
 	} else {
-		buttons_widget = construct_x_button_widget(plugin_data);
+		buttons_widget = construct_x_button_widget(slot);
 	}
 	gtk_box_pack_start(GTK_BOX(hbox), GTK_WIDGET(buttons_widget),
 			   FALSE, FALSE, 0);
@@ -416,14 +509,8 @@ void show_notification_window(kano_notifications_t *plugin_data,
 
 	gtk_widget_show_all(win);
 
-	/* TODO Positioning doesn't take into account the position of the
-	   panel itself. */
-	GdkWindow *gdk_win = gtk_widget_get_window(GTK_WIDGET(win));
-	int win_pos_x = (gdk_screen_width() - gdk_window_get_width(gdk_win))/2,
-	    win_pos_y = gdk_screen_height() - gdk_window_get_height(gdk_win) -
-			plugin_data->panel_height - WINDOW_MARGIN_BOTTOM;
 	gtk_window_set_gravity(GTK_WINDOW(win), GDK_GRAVITY_SOUTH_EAST);
-	gtk_window_move(GTK_WINDOW(win), win_pos_x, win_pos_y);
+	reflow_stack(plugin_data);
 
 	/* Play the sound */
 	if (notification->sound) {
@@ -445,15 +532,18 @@ void show_notification_window(kano_notifications_t *plugin_data,
 	}
 
 
-	plugin_data->window_timeout = g_timeout_add_seconds(ON_TIME,
-				(GSourceFunc) close_notification,
-				(gpointer) plugin_data);
+	slot->display_time = get_display_time_unsafe(plugin_data, notification);
+	g_debug("showing a notification for %u seconds", slot->display_time);
+
+	slot->window_timeout = g_timeout_add_seconds(slot->display_time,
+				(GSourceFunc) slot_timeout_cb,
+				(gpointer) slot);
 }
 
 /* Peeks at the front of the queue and creates and shows a new Gtk Window
  * with the notification.
  *
- * If there is a different active window or if the queue is empty it returns
+ * It keeps going until the stack is full or the queue is empty.
  *
  * NOTE: the G_SOURCE_REMOVE return value is necessary so that when this fn is
  * used with g_idle_add it is only executed once
@@ -462,76 +552,112 @@ void show_notification_window(kano_notifications_t *plugin_data,
 gboolean show_notification_window_from_q(kano_notifications_t *plugin_data)
 {
 	notification_info_t *notif = NULL;
+	notification_slot_t *slot;
 	if (plugin_data == NULL)
 		return G_SOURCE_REMOVE;
 
 	g_mutex_lock(&(plugin_data->lock));
-	if (plugin_data->window == NULL && g_list_length(plugin_data->queue) > 0) {
-		notif = g_list_nth_data(plugin_data->queue, 0);
-		show_notification_window(plugin_data, notif);
+	while ((slot = find_free_slot(plugin_data)) != NULL) {
+		notif = take_next_notification_unsafe(plugin_data);
+		if (!notif)
+			break;
+		show_notification_window(slot, notif);
 	}
 
 	g_mutex_unlock(&(plugin_data->lock));
 	return G_SOURCE_REMOVE;
 }
 
-static void destroy_gtk_window(kano_notifications_t *plugin_data)
+static void destroy_slot_window(notification_slot_t *slot)
 {
-	if (plugin_data->window != NULL) {
-		gtk_widget_destroy(plugin_data->window);
-		plugin_data->window = NULL;
+	if (slot->window != NULL) {
+		gtk_widget_destroy(slot->window);
+		slot->window = NULL;
+		slot->display_time = 0;
 	}
 }
 
-static void destroy_notification_from_q(kano_notifications_t *plugin_data)
+/* This function is "unsafe" because it does not use any locking mechanisms
+ * to prevent concurrency issues and thus is not thread safe.
+ *
+ * The windows above the closed one drop down to fill the gap.
+ */
+static void close_slot_unsafe(notification_slot_t *slot)
 {
-	notification_info_t *notification;
+	kano_notifications_t *plugin_data = slot->plugin_data;
 
-	if (plugin_data != NULL) {
-		notification = g_list_nth_data(plugin_data->queue, 0);
-		plugin_data->queue = g_list_remove(plugin_data->queue, notification);
-		free_notification(notification);
-	}
+	if (slot->window != NULL) {
+		destroy_slot_window(slot);
+		release_notification_unsafe(plugin_data, slot->notification);
+		slot->notification = NULL;
+		reflow_stack(plugin_data);
 
-	return TRUE;
+		/* Change speaker LED colour back after the last notification.
+		 * We use system() so we don't kill next led command for the
+		 * next notification.
+		 */
+		if (!is_showing(plugin_data))
+			system(LED_STOP_CMD);
+
+		g_idle_add((GSourceFunc)show_notification_window_from_q, plugin_data);
+	}
 }
 
-/* This function is "unsafe" because it does not use any locking mechanisms
- * to prevent concurrency issues and thus is not thread safe.
- *
- * A similarly named function (without the _unsafe suffix) is also available
- *
- *
+/*
+ * Make way for a more urgent notification. When the stack is full, the
+ * least urgent window (the oldest one of those) is closed, but its
+ * notification goes back to the queue and is shown again later.
  */
-static void close_notification_unsafe(kano_notifications_t *plugin_data)
+void preempt_notification_unsafe(kano_notifications_t *plugin_data)
 {
-	if (plugin_data->window != NULL) {
-		system(LED_STOP_CMD);
-		destroy_gtk_window(plugin_data);
-		destroy_notification_from_q(plugin_data);
-		g_idle_add((GSourceFunc)show_notification_window_from_q, plugin_data);
+	notification_slot_t *slot, *victim = NULL;
+	guint i;
+
+	if (find_free_slot(plugin_data) != NULL)
+		return;
+
+	for (i = 0; i < MAX_STACK_SIZE; i++) {
+		slot = &(plugin_data->slots[i]);
+		if (slot->window == NULL ||
+		    slot->notification->urgency == URGENCY_CRITICAL)
+			continue;
+
+		if (victim == NULL ||
+		    slot->notification->urgency < victim->notification->urgency ||
+		    (slot->notification->urgency == victim->notification->urgency &&
+		     slot->shown < victim->shown))
+			victim = slot;
 	}
+
+	if (victim == NULL)
+		return;
+
+	remove_window_timeout(victim);
+	destroy_slot_window(victim);
+	requeue_notification_unsafe(plugin_data, victim->notification);
+	victim->notification = NULL;
+	reflow_stack(plugin_data);
+	g_idle_add((GSourceFunc)show_notification_window_from_q, plugin_data);
 }
 
 /*
- * Destroy the notification window and free up the resources.
+ * Destroy all the notification windows and free up the resources.
  *
- * If there was another notification queued up after this one, it will
- * show it.
+ * If there were other notifications queued up after these, it will
+ * show them.
  */
 gboolean close_notification(kano_notifications_t *plugin_data)
 {
-	/* Change speaker LED colour back after notification. 
-	 * We use system() so we don't kill next led command for the next notification.
-	 */
-
-	if (plugin_data->window != NULL) {
-		g_mutex_lock(&(plugin_data->lock));
+	guint i;
 
-		close_notification_unsafe(plugin_data);
+	g_mutex_lock(&(plugin_data->lock));
 
-		g_mutex_unlock(&(plugin_data->lock));
+	for (i = 0; i < MAX_STACK_SIZE; i++) {
+		remove_window_timeout(&(plugin_data->slots[i]));
+		close_slot_unsafe(&(plugin_data->slots[i]));
 	}
 
+	g_mutex_unlock(&(plugin_data->lock));
+
 	return G_SOURCE_REMOVE;
 }
@@ -39,9 +39,6 @@
 
 #define EXTRA_BUTTON_LABEL_COLOUR "#ffffff"
 
-// The following is in seconds. The timer is not guaranteed to be super precise
-#define ON_TIME 60
-
 #define REGISTER_REMINDER \
 	"{" \
 		"\"title\": \"Kano World\", " \
@@ -55,11 +52,12 @@
 typedef struct {
 	notification_info_t *notification;
 	gchar *command;
-	kano_notifications_t *plugin_data;
+	notification_slot_t *slot;
 } gtk_user_data_t;
 
 void launch_cmd(const char *cmd, gboolean hourglass);
 gboolean show_notification_window_from_q(kano_notifications_t *plugin_data);
 gboolean close_notification(kano_notifications_t *plugin_data);
+void preempt_notification_unsafe(kano_notifications_t *plugin_data);
 
 #endif